@@ -91,6 +91,18 @@ extern VImage VMedianImage2d (VImage,VImage,int,VBoolean);
 
 
 
+/* correlation kernels for normalized time series */
+extern int    VCorrNormalize(float *,size_t);
+extern double VCorrDot(const float *,const float *,size_t);
+
+/* compact edge files */
+extern VEdgeFile VEdgeFileCreate(FILE *,VAttrList,size_t,float);
+extern void      VEdgeFileWrite(VEdgeFile,int,int,float);
+extern VEdgeFile VEdgeFileOpen(FILE *,VAttrList *);
+extern size_t    VEdgeFileRead(VEdgeFile,int **,int **,float **);
+extern size_t    VEdgeFileClose(VEdgeFile);
+extern int       VIsEdgeFile(FILE *);
+
 /* segmentation, clustering, binarization */
 extern VImage VBinarizeImage(VImage,VImage,VDouble,VDouble);
 extern VImage VIsodataImage3d(VImage,VImage,VLong,VLong);
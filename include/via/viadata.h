@@ -77,6 +77,13 @@ typedef struct pointStruct{
 } XPoint;
 
 
+/*!
+  \struct VEdgeFile
+  \brief handle of a compact edge file, see EdgeFile.c
+*/
+typedef struct VEdgeFileStruct *VEdgeFile;
+
+
 
 /*
 ** access to a pixel
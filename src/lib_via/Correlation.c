@@ -0,0 +1,87 @@
+/*
+** Correlation kernels for time series normalized by VCorrNormalize.
+** After normalization the linear correlation of two rows is their
+** single precision dot product.
+**
+** Each product is accumulated in NLANES independent float lanes with
+** Kahan compensation, the lanes are summed up in double precision.
+** On x86_64 the kernels are compiled for AVX-512, AVX2 and the
+** baseline instruction set, the best version is selected at load time.
+** On other platforms (e.g. NEON on aarch64) the lane loops are
+** vectorized for the default target.
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+#include <via/via.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define NLANES 16
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__APPLE__) && !defined(__clang__)
+#define CORR_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#define CORR_INLINE __inline__ __attribute__((always_inline))
+#else
+#define CORR_CLONES
+#define CORR_INLINE
+#endif
+
+
+/* compensated dot product of x and y, length n */
+static CORR_INLINE double KahanDot(const float *x,const float *y,size_t n)
+{
+  float s[NLANES],c[NLANES];
+  size_t i,l,m = n - n%NLANES;
+  double sum=0;
+
+  for (l=0; l<NLANES; l++) s[l] = c[l] = 0;
+
+  for (i=0; i<m; i+=NLANES) {
+    for (l=0; l<NLANES; l++) {
+      const float p = x[i+l]*y[i+l] - c[l];
+      const float t = s[l] + p;
+      c[l] = (t - s[l]) - p;
+      s[l] = t;
+    }
+  }
+  for (l=0; l<NLANES; l++) sum += (double)s[l] - (double)c[l];
+  for (i=m; i<n; i++) sum += (double)x[i]*(double)y[i];
+  return sum;
+}
+
+
+/*
+** center x and scale it to unit length, two-pass in double precision.
+** Constant time series are set to zero. Returns 0 in that case, 1 otherwise.
+*/
+CORR_CLONES
+int VCorrNormalize(float *x,size_t n)
+{
+  size_t i;
+  double sum=0,ss=0,mean,s;
+  double tiny=1.0e-8;
+
+  if (n < 1) return 0;
+  for (i=0; i<n; i++) sum += (double)x[i];
+  mean = sum/(double)n;
+  for (i=0; i<n; i++) ss += ((double)x[i]-mean)*((double)x[i]-mean);
+
+  if (ss < tiny) {
+    for (i=0; i<n; i++) x[i] = 0;
+    return 0;
+  }
+  s = 1.0/sqrt(ss);
+  for (i=0; i<n; i++) x[i] = (float)(((double)x[i]-mean)*s);
+  return 1;
+}
+
+
+/* dot product of two rows of length n */
+CORR_CLONES
+double VCorrDot(const float *x,const float *y,size_t n)
+{
+  return KahanDot(x,y,n);
+}
@@ -0,0 +1,420 @@
+/*
+** Compact edge files, e.g. for the edge lists produced by vted.
+**
+** Edges (i,j,e) are stored in chunks of rows. Within a chunk the
+** row index i is run-length encoded as the number of edges per row,
+** the column index j is delta-encoded within each row as a varint,
+** and the edge value e is quantized to 16 bits relative to a per-file
+** scale, values are expected in [0,scale].
+** Edges must be written in row order, and in ascending column order
+** within each row.
+**
+** Layout, all integers little-endian:
+**   header    "LIPEDGE1", u32 version, u32 flags, u64 nvox, f32 scale, u32 0, u64 metalen
+**   metadata  Vista attribute list (e.g. voxel map, geometry) of 'metalen' bytes
+**   chunks    "CHNK", u64 row0, u64 nrows, u64 nedges, u64 nbytes, payload of 'nbytes' bytes:
+**             nrows varints (edges per row), nedges varints (column deltas), nedges u16 (values)
+**   index     "INDX", u64 nchunks, per chunk: u64 offset, u64 row0, u64 nrows, u64 nedges
+**   trailer   u64 offset of index, u64 nchunks, u64 nedges, "LIPEDEND"
+**
+** Chunks can be read sequentially without the index, so that files
+** can be streamed. Writers flush a chunk whenever it holds EDGECHUNK edges,
+** so memory usage is bounded regardless of the number of edges.
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/VImage.h>
+#include <viaio/mu.h>
+#include <via/via.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define EDGECHUNK (1<<20)   /* max number of edges per chunk */
+#define EDGEMAGIC "LIPEDGE1"
+#define EDGEEND   "LIPEDEND"
+#define EDGEVERSION 1
+#define QMAX 65535.0
+
+struct VEdgeFileStruct {
+  FILE  *fp;
+  int    writing;
+  size_t nvox;
+  float  scale;
+  size_t nedges;             /* edges written or read so far */
+
+  /* edges of the current chunk */
+  size_t n,cap;
+  int   *I,*J;
+  float *E;
+  unsigned char *bytes;      /* encoded chunk */
+  size_t bcap;
+
+  /* index of chunks, writer only */
+  size_t nchunks,icap;
+  size_t *index;             /* offset, row0, nrows, nedges per chunk */
+  size_t offset;             /* current file offset */
+};
+
+
+static void PutU32(unsigned char *b,unsigned int v)
+{
+  int k;
+  for (k=0; k<4; k++) b[k] = (unsigned char)((v >> (8*k)) & 0xff);
+}
+
+static void PutU64(unsigned char *b,size_t v)
+{
+  int k;
+  for (k=0; k<8; k++) b[k] = (unsigned char)(((unsigned long long)v >> (8*k)) & 0xff);
+}
+
+static unsigned int GetU32(const unsigned char *b)
+{
+  int k;
+  unsigned int v=0;
+  for (k=3; k>=0; k--) v = (v << 8) | b[k];
+  return v;
+}
+
+static size_t GetU64(const unsigned char *b)
+{
+  int k;
+  unsigned long long v=0;
+  for (k=7; k>=0; k--) v = (v << 8) | b[k];
+  return (size_t)v;
+}
+
+static size_t PutVarint(unsigned char *b,size_t v)
+{
+  size_t k=0;
+  while (v >= 0x80) {
+    b[k++] = (unsigned char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  b[k++] = (unsigned char)v;
+  return k;
+}
+
+static size_t GetVarint(const unsigned char *b,size_t len,size_t *pos)
+{
+  size_t v=0;
+  int shift=0;
+  while (*pos < len) {
+    unsigned char c = b[(*pos)++];
+    v |= (size_t)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) return v;
+    shift += 7;
+    if (shift >= 64) break;
+  }
+  VError(" edge file: corrupt chunk");
+  return 0;
+}
+
+
+static void WriteBytes(VEdgeFile ef,const void *b,size_t n)
+{
+  if (n > 0 && fwrite(b,1,n,ef->fp) != n) VError(" edge file: write failed");
+  ef->offset += n;
+}
+
+static void ReadBytes(VEdgeFile ef,void *b,size_t n)
+{
+  if (n > 0 && fread(b,1,n,ef->fp) != n) VError(" edge file: unexpected end of file");
+}
+
+
+static void EnsureBytes(VEdgeFile ef,size_t n)
+{
+  if (n <= ef->bcap) return;
+  ef->bcap = n;
+  ef->bytes = (unsigned char *) VRealloc(ef->bytes,ef->bcap);
+}
+
+
+static VEdgeFile EdgeFileAlloc(FILE *fp,int writing)
+{
+  VEdgeFile ef = (VEdgeFile) VCalloc(1,sizeof(struct VEdgeFileStruct));
+  ef->fp = fp;
+  ef->writing = writing;
+  ef->cap = 1024;
+  ef->I = (int *) VCalloc(ef->cap,sizeof(int));
+  ef->J = (int *) VCalloc(ef->cap,sizeof(int));
+  ef->E = (float *) VCalloc(ef->cap,sizeof(float));
+  return ef;
+}
+
+
+/* encode and write the current chunk */
+static void FlushChunk(VEdgeFile ef)
+{
+  size_t k,l,r,pos,n = ef->n;
+  unsigned char hdr[36];
+
+  if (n == 0) return;
+  size_t row0 = (size_t)ef->I[0];
+  size_t nrows = (size_t)ef->I[n-1] - row0 + 1;
+
+  /* worst case: 10 bytes per varint, 2 bytes per value */
+  EnsureBytes(ef,10*nrows + 12*n);
+  pos = 0;
+  k = 0;
+  for (r=row0; r<row0+nrows; r++) {
+    l = k;
+    while (k < n && (size_t)ef->I[k] == r) k++;
+    pos += PutVarint(&ef->bytes[pos],k-l);
+  }
+  for (k=0; k<n; k++) {
+    size_t prev = (k == 0 || ef->I[k] != ef->I[k-1]) ? 0 : (size_t)ef->J[k-1];
+    pos += PutVarint(&ef->bytes[pos],(size_t)ef->J[k] - prev);
+  }
+  for (k=0; k<n; k++) {
+    double q = (double)ef->E[k]/(double)ef->scale*QMAX + 0.5;
+    if (q < 0) q = 0;
+    if (q > QMAX) q = QMAX;
+    unsigned int u = (unsigned int)q;
+    ef->bytes[pos++] = (unsigned char)(u & 0xff);
+    ef->bytes[pos++] = (unsigned char)(u >> 8);
+  }
+
+  /* index entry */
+  if (ef->nchunks >= ef->icap) {
+    ef->icap = (ef->icap < 64) ? 64 : 2*ef->icap;
+    ef->index = (size_t *) VRealloc(ef->index,4*ef->icap*sizeof(size_t));
+  }
+  size_t *ix = &ef->index[4*ef->nchunks];
+  ix[0] = ef->offset;
+  ix[1] = row0;
+  ix[2] = nrows;
+  ix[3] = n;
+  ef->nchunks++;
+
+  memcpy(hdr,"CHNK",4);
+  PutU64(&hdr[4],row0);
+  PutU64(&hdr[12],nrows);
+  PutU64(&hdr[20],n);
+  PutU64(&hdr[28],pos);
+  WriteBytes(ef,hdr,36);
+  WriteBytes(ef,ef->bytes,pos);
+  ef->n = 0;
+}
+
+
+/*!
+  \fn VEdgeFile VEdgeFileCreate(FILE *fp,VAttrList meta,size_t nvox,float scale)
+  \brief start writing an edge file
+  \param fp     output file
+  \param meta   attributes stored with the edges (e.g. voxel map), may be NULL
+  \param nvox   number of vertices
+  \param scale  upper bound of the edge values
+*/
+VEdgeFile VEdgeFileCreate(FILE *fp,VAttrList meta,size_t nvox,float scale)
+{
+  unsigned char hdr[40];
+  size_t metalen=0;
+  union { float f; unsigned int u; } s;
+
+  if (scale <= 0) VError(" edge file: illegal scale %f",scale);
+  VEdgeFile ef = EdgeFileAlloc(fp,1);
+  ef->nvox = nvox;
+  ef->scale = scale;
+
+  /* encode metadata */
+  FILE *tmp = tmpfile();
+  if (tmp == NULL) VError(" edge file: could not create temporary file");
+  if (meta == NULL) meta = VCreateAttrList();
+  if (! VWriteFile (tmp,meta)) VError(" edge file: err writing metadata");
+  metalen = (size_t)ftell(tmp);
+  rewind(tmp);
+
+  memcpy(hdr,EDGEMAGIC,8);
+  PutU32(&hdr[8],EDGEVERSION);
+  PutU32(&hdr[12],0);
+  PutU64(&hdr[16],nvox);
+  s.f = scale;
+  PutU32(&hdr[24],s.u);
+  PutU32(&hdr[28],0);
+  PutU64(&hdr[32],metalen);
+  WriteBytes(ef,hdr,40);
+
+  EnsureBytes(ef,metalen);
+  if (fread(ef->bytes,1,metalen,tmp) != metalen) VError(" edge file: err reading metadata");
+  WriteBytes(ef,ef->bytes,metalen);
+  fclose(tmp);
+  return ef;
+}
+
+
+/*!
+  \fn void VEdgeFileWrite(VEdgeFile ef,int i,int j,float e)
+  \brief append edge (i,j) with value e, edges must be sorted by i, then by j.
+*/
+void VEdgeFileWrite(VEdgeFile ef,int i,int j,float e)
+{
+  if (i < 0 || j < 0 || (size_t)i >= ef->nvox || (size_t)j >= ef->nvox)
+    VError(" edge file: illegal edge %d %d",i,j);
+  if (ef->n > 0) {
+    int i0 = ef->I[ef->n-1];
+    if (i < i0 || (i == i0 && j < ef->J[ef->n-1])) VError(" edge file: edges not sorted, %d %d",i,j);
+
+    /* chunks end at row boundaries */
+    if (i != i0 && ef->n >= EDGECHUNK) FlushChunk(ef);
+  }
+
+  if (ef->n >= ef->cap) {
+    ef->cap *= 2;
+    ef->I = (int *) VRealloc(ef->I,ef->cap*sizeof(int));
+    ef->J = (int *) VRealloc(ef->J,ef->cap*sizeof(int));
+    ef->E = (float *) VRealloc(ef->E,ef->cap*sizeof(float));
+  }
+  ef->I[ef->n] = i;
+  ef->J[ef->n] = j;
+  ef->E[ef->n] = e;
+  ef->n++;
+  ef->nedges++;
+}
+
+
+/*!
+  \fn VEdgeFile VEdgeFileOpen(FILE *fp,VAttrList *meta)
+  \brief start reading an edge file, returns the metadata in *meta.
+  The file is read sequentially, it need not be seekable.
+*/
+VEdgeFile VEdgeFileOpen(FILE *fp,VAttrList *meta)
+{
+  unsigned char hdr[40];
+  union { float f; unsigned int u; } s;
+
+  VEdgeFile ef = EdgeFileAlloc(fp,0);
+  ReadBytes(ef,hdr,40);
+  if (memcmp(hdr,EDGEMAGIC,8) != 0) VError(" not an edge file");
+  if (GetU32(&hdr[8]) != EDGEVERSION) VError(" edge file: unsupported version %u",GetU32(&hdr[8]));
+  ef->nvox = GetU64(&hdr[16]);
+  s.u = GetU32(&hdr[24]);
+  ef->scale = s.f;
+  size_t metalen = GetU64(&hdr[32]);
+
+  /* decode metadata */
+  EnsureBytes(ef,metalen);
+  ReadBytes(ef,ef->bytes,metalen);
+  FILE *tmp = tmpfile();
+  if (tmp == NULL) VError(" edge file: could not create temporary file");
+  if (fwrite(ef->bytes,1,metalen,tmp) != metalen) VError(" edge file: err reading metadata");
+  rewind(tmp);
+  VAttrList list = VReadFile (tmp,NULL);
+  if (! list) VError(" edge file: err reading metadata");
+  fclose(tmp);
+  if (meta) *meta = list;
+  return ef;
+}
+
+
+/*!
+  \fn size_t VEdgeFileRead(VEdgeFile ef,int **I,int **J,float **E)
+  \brief read the next chunk of edges. Returns the number of edges, 0 at the end of the file.
+  The arrays are owned by 'ef' and remain valid until the next call.
+*/
+size_t VEdgeFileRead(VEdgeFile ef,int **I,int **J,float **E)
+{
+  unsigned char hdr[36];
+  size_t k,l,r,pos,cnt;
+
+  ReadBytes(ef,hdr,4);
+  if (memcmp(hdr,"INDX",4) == 0) return 0;
+  if (memcmp(hdr,"CHNK",4) != 0) VError(" edge file: corrupt chunk");
+  ReadBytes(ef,&hdr[4],32);
+  size_t row0   = GetU64(&hdr[4]);
+  size_t nrows  = GetU64(&hdr[12]);
+  size_t n      = GetU64(&hdr[20]);
+  size_t nbytes = GetU64(&hdr[28]);
+  if (row0+nrows > ef->nvox || nbytes < 2*n) VError(" edge file: corrupt chunk");
+
+  EnsureBytes(ef,nbytes);
+  ReadBytes(ef,ef->bytes,nbytes);
+  if (n > ef->cap) {
+    ef->cap = n;
+    ef->I = (int *) VRealloc(ef->I,ef->cap*sizeof(int));
+    ef->J = (int *) VRealloc(ef->J,ef->cap*sizeof(int));
+    ef->E = (float *) VRealloc(ef->E,ef->cap*sizeof(float));
+  }
+
+  size_t len = nbytes - 2*n;
+  pos = 0;
+  k = 0;
+  for (r=row0; r<row0+nrows; r++) {
+    cnt = GetVarint(ef->bytes,len,&pos);
+    if (k+cnt > n) VError(" edge file: corrupt chunk");
+    for (l=0; l<cnt; l++) ef->I[k++] = (int)r;
+  }
+  if (k != n) VError(" edge file: corrupt chunk");
+  for (k=0; k<n; k++) {
+    size_t prev = (k == 0 || ef->I[k] != ef->I[k-1]) ? 0 : (size_t)ef->J[k-1];
+    ef->J[k] = (int)(prev + GetVarint(ef->bytes,len,&pos));
+  }
+  const unsigned char *q = &ef->bytes[len];
+  for (k=0; k<n; k++) {
+    unsigned int u = (unsigned int)q[2*k] | ((unsigned int)q[2*k+1] << 8);
+    ef->E[k] = (float)((double)u/QMAX*(double)ef->scale);
+  }
+
+  ef->nedges += n;
+  *I = ef->I;
+  *J = ef->J;
+  *E = ef->E;
+  return n;
+}
+
+
+/*!
+  \fn size_t VEdgeFileClose(VEdgeFile ef)
+  \brief finish an edge file. Writers flush the last chunk and write the
+  index and trailer. Returns the number of edges written or read.
+  The file itself is not closed.
+*/
+size_t VEdgeFileClose(VEdgeFile ef)
+{
+  size_t k,nedges = ef->nedges;
+  unsigned char b[32];
+
+  if (ef->writing) {
+    FlushChunk(ef);
+
+    size_t ioffset = ef->offset;
+    memcpy(b,"INDX",4);
+    PutU64(&b[4],ef->nchunks);
+    WriteBytes(ef,b,12);
+    for (k=0; k<4*ef->nchunks; k++) {
+      PutU64(b,ef->index[k]);
+      WriteBytes(ef,b,8);
+    }
+    PutU64(&b[0],ioffset);
+    PutU64(&b[8],ef->nchunks);
+    PutU64(&b[16],nedges);
+    memcpy(&b[24],EDGEEND,8);
+    WriteBytes(ef,b,32);
+    fflush(ef->fp);
+  }
+
+  VFree(ef->I);
+  VFree(ef->J);
+  VFree(ef->E);
+  VFree(ef->bytes);
+  VFree(ef->index);
+  VFree(ef);
+  return nedges;
+}
+
+
+/*!
+  \fn int VIsEdgeFile(FILE *fp)
+  \brief whether the stream starts with an edge file, the stream position is unchanged.
+*/
+int VIsEdgeFile(FILE *fp)
+{
+  int c = fgetc(fp);
+  if (c == EOF) return 0;
+  ungetc(c,fp);
+  return (c == EDGEMAGIC[0]);
+}
@@ -1,48 +1,33 @@
 /*
 ** Kendall's coefficient of concordance - Kendall's W
-** 
+**
 ** G.Lohmann, July 2010
 */
 #include <gsl/gsl_matrix.h>
-#include <gsl/gsl_vector.h>
-#include <gsl/gsl_errno.h>
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
-#include <gsl/gsl_sort_double.h>
 #include <gsl/gsl_math.h>
-#include <gsl/gsl_cdf.h>
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-extern void gsl_sort_vector_index (gsl_permutation *,gsl_vector *);
-
 #define SQR(x) ((x) * (x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES 4
+
 
-double kendall(size_t **xrank,double *r,int n,int m,int otype)
+/* W from the sum of squared deviations S of the rank sums */
+double kendall(double S,int n,int m,int otype)
 {
-  int i,j;
-  double S,W,R,chi_square=0;
+  double W,chi_square=0;
   double nx=0,mx=0;
 
   nx = (double)n;
   mx = (double)m;
 
-  for (i=0; i<n; i++) {
-    r[i] = 0;
-    for (j=0; j<m; j++) r[i] += xrank[j][i];
-  }
-
-  R = 0;
-  for (i=0; i<n; i++) R += r[i];
-  R /= nx;
-
-  S = 0;
-  for (i=0; i<n; i++) S += SQR(r[i] - R);
-  
   W = 12.0*S/(mx*mx*(nx*nx-1)*nx);
   if (otype == 0) return W;
 
@@ -52,41 +37,150 @@ double kendall(size_t **xrank,double *r,int n,int m,int otype)
   return (chi_square - nx)/(sqrt(2.0*nx));
 }
 
+/* scratch space of VKendall_W, one per thread */
+typedef struct KendallWorkStruct {
+  size_t n;
+  double *r;            /* rank sums */
+  unsigned int *key;    /* sort keys, two buffers */
+  unsigned int *key2;
+  unsigned int *idx;    /* item indices, two buffers */
+  unsigned int *idx2;
+} KendallWork;
+
+
+/* workspace for m raters (subjects) and up to n items (voxels) */
+KendallWork *
+VKendallWorkspace(int m,size_t n)
+{
+  KendallWork *work = (KendallWork *) calloc(1,sizeof(KendallWork));
+  if (!work) return NULL;
+
+  work->n    = n;
+  work->r    = (double *) calloc(n,sizeof(double));
+  work->key  = (unsigned int *) calloc(n,sizeof(unsigned int));
+  work->key2 = (unsigned int *) calloc(n,sizeof(unsigned int));
+  work->idx  = (unsigned int *) calloc(n,sizeof(unsigned int));
+  work->idx2 = (unsigned int *) calloc(n,sizeof(unsigned int));
+  return work;
+}
+
+
+void
+VKendallFree(KendallWork *work)
+{
+  if (work == NULL) return;
+  free(work->r);
+  free(work->key);
+  free(work->key2);
+  free(work->idx);
+  free(work->idx2);
+  free(work);
+}
+
+
+/*
+** Order-preserving integer key of a correlation value. The data are
+** single precision correlations, so the bit pattern of the float with
+** the sign handled as in IEEE total order gives exact comparisons.
+*/
+static unsigned int
+SortKey(double v)
+{
+  union { float f; unsigned int u; } x;
+  x.f = (float)v;
+  if (x.f == 0) x.f = 0;    /* -0 and +0 tie */
+  return (x.u & 0x80000000u) ? ~x.u : (x.u | 0x80000000u);
+}
+
+
+/*
+** Sort the n keys of 'work' by LSD radix sort, 8 bits per pass.
+** The sort is stable, so ties are ranked in index order.
+** On return work->idx holds the item indices in ascending order.
+*/
+static void
+RadixSort(KendallWork *work,int n)
+{
+  int i,p,d;
+  size_t count[RADIX_PASSES][RADIX_SIZE];
+  unsigned int *key=work->key,*key2=work->key2,*idx=work->idx,*idx2=work->idx2,*tmp;
+
+  /* histograms of all digits in one pass */
+  memset(count,0,sizeof(count));
+  for (i=0; i<n; i++) {
+    const unsigned int k = key[i];
+    for (p=0; p<RADIX_PASSES; p++) count[p][(k >> (p*RADIX_BITS)) & (RADIX_SIZE-1)]++;
+  }
+
+  for (p=0; p<RADIX_PASSES; p++) {
+    const int shift = p*RADIX_BITS;
+    size_t *c = count[p];
+    size_t sum=0;
+
+    /* all keys share this digit, nothing to do */
+    if (c[(key[0] >> shift) & (RADIX_SIZE-1)] == (size_t)n) continue;
+
+    for (d=0; d<RADIX_SIZE; d++) {
+      size_t t = c[d];
+      c[d] = sum;
+      sum += t;
+    }
+    for (i=0; i<n; i++) {
+      size_t l = c[(key[i] >> shift) & (RADIX_SIZE-1)]++;
+      key2[l] = key[i];
+      idx2[l] = idx[i];
+    }
+    tmp = key; key = key2; key2 = tmp;
+    tmp = idx; idx = idx2; idx2 = tmp;
+  }
+
+  work->key = key;
+  work->key2 = key2;
+  work->idx = idx;
+  work->idx2 = idx2;
+}
+
+
+/*
+** Kendall's W of the first 'nvoxels' columns of data, rows are raters.
+** Reentrant, all scratch space is held in 'work'.
+** Each row is ranked in O(n) by radix sort, the ranks are added to the
+** rank sums, and the squared deviations of the rank sums are accumulated
+** while the ranks of the last row are added.
+*/
 double
-VKendall_W(gsl_matrix *data,int nvoxels,int otype)
+VKendall_W(gsl_matrix *data,int nvoxels,int otype,KendallWork *work)
 {
   int i,j,n,m;
-  double W0;
-  static double *r=NULL;
-  static gsl_vector *vec = NULL;
-  static size_t **xrank=NULL;
-  static gsl_permutation *perm=NULL,*rank=NULL;
-
+  double S=0,R,d;
+  double *r = work->r;
 
   m = data->size1;
   n = nvoxels;
+  if (n < 2) return 0;
 
-  if (vec == NULL) {
-    r    = (double *) calloc(data->size2,sizeof(double));
-    vec  = gsl_vector_calloc(data->size2);
-    perm = gsl_permutation_alloc(data->size2);
-    rank = gsl_permutation_alloc(data->size2);
+  /* mean rank sum, ranks of each row are 0...n-1 */
+  R = (double)m*(double)(n-1)/2.0;
 
-    xrank = (size_t **) calloc(m,sizeof(size_t *));
-    for (i=0; i<m; i++) xrank[i] = (size_t *) calloc(data->size2,sizeof(size_t));
-  }
-
-  gsl_vector_set_all (vec,9999);
+  memset(r,0,n*sizeof(double));
   for (i=0; i<m; i++) {
+    const double *x = gsl_matrix_const_ptr(data,i,0);
     for (j=0; j<n; j++) {
-      gsl_vector_set(vec,j,gsl_matrix_get(data,i,j));
+      work->key[j] = SortKey(x[j]);
+      work->idx[j] = (unsigned int)j;
     }
-    gsl_sort_vector_index (perm, vec);
-    gsl_permutation_inverse (rank, perm);
-    for (j=0; j<n; j++) xrank[i][j] = rank->data[j];
-  }
+    RadixSort(work,n);
 
-  /* Kendall's W of measured data */
-  W0 = kendall(xrank,r,n,m,otype);
-  return W0;
+    const unsigned int *idx = work->idx;
+    if (i < m-1) {
+      for (j=0; j<n; j++) r[idx[j]] += (double)j;
+    }
+    else {
+      for (j=0; j<n; j++) {
+	d = r[idx[j]] + (double)j - R;
+	S += d*d;
+      }
+    }
+  }
+  return kendall(S,n,m,otype);
 }
@@ -9,6 +9,7 @@
 #include <gsl/gsl_errno.h>
 
 #include <math.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -60,22 +61,52 @@ AveVar(double *arr,int n,double *ave,double *var)
 }
 
 
+/* scratch space of VOCCC, one per thread */
+typedef struct OCCCWorkStruct {
+  gsl_matrix *cov;
+  gsl_vector *ave;
+  gsl_vector *var;
+} OCCCWork;
+
+
+OCCCWork *
+VOCCCWorkspace(int nsubjects)
+{
+  OCCCWork *work = (OCCCWork *) calloc(1,sizeof(OCCCWork));
+  if (!work) return NULL;
+  work->ave = gsl_vector_calloc(nsubjects);
+  work->var = gsl_vector_calloc(nsubjects);
+  work->cov = gsl_matrix_calloc(nsubjects,nsubjects);
+  return work;
+}
+
+
+void
+VOCCCFree(OCCCWork *work)
+{
+  if (work == NULL) return;
+  gsl_vector_free(work->ave);
+  gsl_vector_free(work->var);
+  gsl_matrix_free(work->cov);
+  free(work);
+}
+
+
+/*
+** OCCC of the first 'nvoxels' columns of data, rows are subjects.
+** Reentrant, all scratch space is held in 'work'.
+*/
 double
-VOCCC(gsl_matrix *data,int nvoxels,int verbose)
+VOCCC(gsl_matrix *data,int nvoxels,int verbose,OCCCWork *work)
 {
   int i,j,k;
   double sum1,sum2,sum3,mean,varx,u,v;
-  static gsl_matrix *cov=NULL;
-  static gsl_vector *ave=NULL,*var=NULL;
+  gsl_matrix *cov = work->cov;
+  gsl_vector *ave = work->ave;
+  gsl_vector *var = work->var;
 
   int nsubjects = data->size1;
 
-  if (ave == NULL) {
-    ave = gsl_vector_calloc(nsubjects);
-    var = gsl_vector_calloc(nsubjects);
-    cov = gsl_matrix_calloc(nsubjects,nsubjects);
-  }
-
   for (i=0; i<nsubjects; i++) {
     double *ptr1 = gsl_matrix_ptr(data,i,0);
     AveVar(ptr1,nvoxels,&mean,&varx);
@@ -9,23 +9,38 @@
 #include <viaio/option.h>
 #include <viaio/os.h>
 #include <viaio/VImage.h>
+#include <via/via.h>
 
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_errno.h>
+#include <gsl/gsl_cblas.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
 
 #define SQR(x) ((x) * (x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
-extern double VOCCC(gsl_matrix *,int,int);
+#define SEEDBLOCK 64        /* max number of seeds processed together */
+#define TILEMEM   (1<<24)   /* max number of floats in the seed tiles of one thread */
+
+typedef struct KendallWorkStruct KendallWork;
+typedef struct OCCCWorkStruct OCCCWork;
+
+extern KendallWork *VKendallWorkspace(int,size_t);
+extern void VKendallFree(KendallWork *);
+extern double VKendall_W(gsl_matrix *,int,int,KendallWork *);
+extern OCCCWork *VOCCCWorkspace(int);
+extern void VOCCCFree(OCCCWork *);
+extern double VOCCC(gsl_matrix *,int,int,OCCCWork *);
 extern double VICC(gsl_matrix *,int);
-extern double VKendall_W(gsl_matrix *,int,int);
 extern double SpearmanCorr(const float *data1,const float *data2, int n);
 
 int metric = 1;
@@ -39,40 +54,360 @@ VDictEntry TypeDict[] = {
 
 
 
+/* concordance of the first 'len' columns of data, workspaces are per thread */
 double
-Correlation(const float *arr1,const float *arr2,int n)
+Concordance(gsl_matrix *data,int len,int type,int otype,KendallWork *kwork,OCCCWork *owork)
+{
+  double v=0;
+  if (type == 0)
+    v = VKendall_W(data,len,otype,kwork);
+  else if (type == 1)
+    v = VOCCC(data,len,verbose,owork);
+  else
+    VError(" illegal type");
+  return v;
+}
+
+
+/*
+** number of seeds per block such that the tiles of all subjects
+** need at most TILEMEM floats
+*/
+int
+SeedBlockSize(int nsubjects,int n)
+{
+  size_t nb = TILEMEM/((size_t)nsubjects*(size_t)n);
+  if (nb > SEEDBLOCK) nb = SEEDBLOCK;
+  if (nb < 1) nb = 1;
+  return (int)nb;
+}
+
+
+/*
+** correlations of the seeds i0 <= i < i0+ni with all rows, one ni x n tile
+** per subject computed by a single SGEMM. Rows of mat[s] must be normalized
+** to unit length. Row ii of subject s is at T[(s*ni+ii)*n].
+*/
+void
+SeedTiles(gsl_matrix_float **mat,int nsubjects,int i0,int ni,float *T)
+{
+  int s;
+  for (s=0; s<nsubjects; s++) {
+    const gsl_matrix_float *X = mat[s];
+    size_t n = X->size1;
+    cblas_sgemm(CblasRowMajor,CblasNoTrans,CblasTrans,ni,(int)n,(int)X->size2,
+		1.0f,gsl_matrix_float_const_ptr(X,i0,0),(int)X->tda,X->data,(int)X->tda,
+		0.0f,&T[(size_t)s*ni*n],(int)n);
+  }
+}
+
+
+/* pixel types accepted as functional data */
+VBoolean
+DataRepn(VRepnKind repn)
+{
+  return (repn == VShortRepn || repn == VFloatRepn || repn == VUByteRepn);
+}
+
+
+#define CopyPlanes(type) \
+{ \
+  for (k=first; k<=last; k++) { \
+    const type *plane = (const type *) VPixelPtr(slice,k,0,0); \
+    for (i=i0; i<i1; i++) x[(size_t)i*tda + k-first] = (float) plane[off[i]]; \
+  } \
+}
+
+
+/*
+** copy timesteps first...last of all voxels of map into the rows of X.
+** Voxels of one slice are consecutive in map, each slice is copied in a
+** single typed pass over its planes.
+*/
+void
+LoadTimeSeries(VImage *src,VImage map,int first,int last,gsl_matrix_float *X)
+{
+  int i,i0,i1,k,b;
+  int nvoxels = VImageNColumns(map);
+  size_t tda = X->tda;
+  float *x = X->data;
+  int *off = (int *) VCalloc(nvoxels,sizeof(int));
+
+  for (i0=0; i0<nvoxels; i0=i1) {
+    b = VPixel(map,0,0,i0,VShort);
+    VImage slice = src[b];
+    for (i1=i0; i1<nvoxels && VPixel(map,0,0,i1,VShort) == b; i1++)
+      off[i1] = VPixel(map,0,1,i1,VShort)*VImageNColumns(slice) + VPixel(map,0,2,i1,VShort);
+
+    switch (VPixelRepn(slice)) {
+    case VShortRepn:
+      CopyPlanes(VShort);
+      break;
+    case VFloatRepn:
+      CopyPlanes(VFloat);
+      break;
+    case VUByteRepn:
+      CopyPlanes(VUByte);
+      break;
+    default:
+      VError(" illegal pixel repn");
+    }
+  }
+  VFree(off);
+}
+
+
+/*
+** voxel coordinates as struct of arrays, and the neighbourhood of
+** each voxel that is excluded because of spatial smoothness
+*/
+typedef struct VoxelGridStruct {
+  int nvoxels,nslices,nrows,ncols;
+  short *b,*r,*c;       /* coordinates of each voxel */
+  int *index;           /* voxel index at each grid point, -1 outside the mask */
+  int noff;
+  int *off;             /* neighbourhood offsets (db,dr,dc) in voxel order */
+} VoxelGrid;
+
+
+/* grid for the voxels of map, neighbours are closer than sqrt(rad2) */
+VoxelGrid *
+VoxelGridCreate(VImage map,int nslices,int nrows,int ncols,int rad2)
+{
+  int i,m,k,l,w;
+  VoxelGrid *G = (VoxelGrid *) VCalloc(1,sizeof(VoxelGrid));
+  size_t npix = (size_t)nslices*nrows*ncols;
+
+  G->nvoxels = VImageNColumns(map);
+  G->nslices = nslices;
+  G->nrows = nrows;
+  G->ncols = ncols;
+  G->b = (short *) VCalloc(G->nvoxels,sizeof(short));
+  G->r = (short *) VCalloc(G->nvoxels,sizeof(short));
+  G->c = (short *) VCalloc(G->nvoxels,sizeof(short));
+  G->index = (int *) VCalloc(npix,sizeof(int));
+  memset(G->index,0xff,npix*sizeof(int));
+
+  for (i=0; i<G->nvoxels; i++) {
+    G->b[i] = VPixel(map,0,0,i,VShort);
+    G->r[i] = VPixel(map,0,1,i,VShort);
+    G->c[i] = VPixel(map,0,2,i,VShort);
+    G->index[((size_t)G->b[i]*nrows + G->r[i])*ncols + G->c[i]] = i;
+  }
+
+  /* offsets in slice, row, column order, so that neighbours come out sorted */
+  w = (int)sqrt((double)rad2);
+  G->off = (int *) VCalloc(3*(2*w+1)*(2*w+1)*(2*w+1),sizeof(int));
+  G->noff = 0;
+  for (m=-w; m<=w; m++) {
+    for (k=-w; k<=w; k++) {
+      for (l=-w; l<=w; l++) {
+	if (m*m + k*k + l*l >= rad2) continue;
+	G->off[3*G->noff]   = m;
+	G->off[3*G->noff+1] = k;
+	G->off[3*G->noff+2] = l;
+	G->noff++;
+      }
+    }
+  }
+  return G;
+}
+
+
+void
+VoxelGridFree(VoxelGrid *G)
+{
+  VFree(G->b);
+  VFree(G->r);
+  VFree(G->c);
+  VFree(G->index);
+  VFree(G->off);
+  VFree(G);
+}
+
+
+/* ascending indices of the voxels in the neighbourhood of voxel i, including i */
+int
+ExcludedVoxels(VoxelGrid *G,int i,int *excl)
+{
+  int e,n=0;
+  for (e=0; e<G->noff; e++) {
+    int b = G->b[i] + G->off[3*e];
+    int r = G->r[i] + G->off[3*e+1];
+    int c = G->c[i] + G->off[3*e+2];
+    if (b < 0 || b >= G->nslices || r < 0 || r >= G->nrows || c < 0 || c >= G->ncols) continue;
+    int j = G->index[((size_t)b*G->nrows + r)*G->ncols + c];
+    if (j >= 0) excl[n++] = j;
+  }
+  return n;
+}
+
+
+int
+CompareInt(const void *a,const void *b)
 {
-  int i;
-  double sx,sy,sxx,syy,sxy,rx;
-  double tiny=1.0e-4;
-
-  sxx = syy = sxy = sx = sy = 0;
-  for (i=0; i<n; i++) {
-    const double u = (double)arr1[i];
-    const double v = (double)arr2[i];
-    sx  += u;
-    sy  += v;
-    sxx += u*u;
-    syy += v*v;
-    sxy += u*v;
+  int u = *(const int *)a;
+  int v = *(const int *)b;
+  if (u < v) return -1;
+  if (u > v) return 1;
+  return 0;
+}
+
+
+/*
+** parcel index of each voxel in map, -1 if unlabelled.
+** Parcels are numbered in ascending order of their labels.
+*/
+int *
+VoxelParcels(VImage atlas,VImage map,int nvoxels,int *nparcels,int **labels)
+{
+  int i,k,l,b,r,c,np;
+  int *parcel = (int *) VCalloc(nvoxels,sizeof(int));
+  int *lab = (int *) VCalloc(nvoxels,sizeof(int));
+
+  k = 0;
+  for (i=0; i<nvoxels; i++) {
+    b = VPixel(map,0,0,i,VShort);
+    r = VPixel(map,0,1,i,VShort);
+    c = VPixel(map,0,2,i,VShort);
+    l = (int)(VGetPixel(atlas,b,r,c) + 0.5);
+    parcel[i] = l;
+    if (l > 0) lab[k++] = l;
   }
-  const double nx= n;
-  const double u = nx*sxx - sx*sx;
-  const double v = nx*syy - sy*sy;
-  rx = 0;
-  if (u*v > tiny)
-    rx = (nx*sxy - sx*sy)/sqrt(u*v);
-  return rx;
+  qsort(lab,k,sizeof(int),CompareInt);
+  np = 0;
+  for (i=0; i<k; i++) {
+    if (i == 0 || lab[i] != lab[i-1]) lab[np++] = lab[i];
+  }
+  if (np < 3) VError(" atlas has less than three labels inside the mask");
+
+  for (i=0; i<nvoxels; i++) {
+    l = parcel[i];
+    if (l < 1) parcel[i] = -1;
+    else parcel[i] = (int)((int *) bsearch(&l,lab,np,sizeof(int),CompareInt) - lab);
+  }
+  *nparcels = np;
+  *labels = lab;
+  return parcel;
+}
+
+
+/* mean time series of each parcel */
+gsl_matrix_float *
+ParcelMean(gsl_matrix_float *X,int *parcel,int nparcels)
+{
+  int i,k,p,nt = X->size2;
+  gsl_matrix_float *P = gsl_matrix_float_calloc(nparcels,nt);
+  int *count = (int *) VCalloc(nparcels,sizeof(int));
+
+  for (i=0; i<X->size1; i++) {
+    if (parcel[i] < 0) continue;
+    const float *x = gsl_matrix_float_const_ptr(X,i,0);
+    float *y = gsl_matrix_float_ptr(P,parcel[i],0);
+    for (k=0; k<nt; k++) y[k] += x[k];
+    count[parcel[i]]++;
+  }
+  for (p=0; p<nparcels; p++) {
+    float *y = gsl_matrix_float_ptr(P,p,0);
+    for (k=0; k<nt; k++) y[k] /= (float)count[p];
+  }
+  VFree(count);
+  return P;
+}
+
+
+/*
+** CCM on the parcel x parcel correlation matrices. The result is written
+** to all voxels of a parcel, or as a table of labels (row 0) and values (row 1).
+*/
+VImage
+ParcelCCM(gsl_matrix_float **mat,VImage map,VImage atlas,VBoolean project,VImage dest,
+	  int nsubjects,int nvoxels,int nt,int type,int otype)
+{
+  int i,j,k,p,s,np=0,b,r,c;
+  int *labels=NULL;
+
+  int *parcel = VoxelParcels(atlas,map,nvoxels,&np,&labels);
+  fprintf(stderr,"# atlas: %d parcels\n",np);
+
+  gsl_matrix_float **pmat = (gsl_matrix_float **) VCalloc(nsubjects,sizeof(gsl_matrix_float *));
+  for (s=0; s<nsubjects; s++) {
+    pmat[s] = ParcelMean(mat[s],parcel,np);
+    for (p=0; p<np; p++) VCorrNormalize(gsl_matrix_float_ptr(pmat[s],p,0),nt);
+  }
+
+  float *ccm = (float *) VCalloc(np,sizeof(float));
+
+  int nb = SeedBlockSize(nsubjects,np);
+  int nblocks = (np+nb-1)/nb;
+
+#pragma omp parallel private(j,k,s)
+  {
+    gsl_matrix *data = gsl_matrix_calloc(nsubjects,np);
+    float *T = (float *) VCalloc((size_t)nsubjects*nb*np,sizeof(float));
+    KendallWork *kwork = (type == 0) ? VKendallWorkspace(nsubjects,np) : NULL;
+    OCCCWork *owork = (type == 1) ? VOCCCWorkspace(nsubjects) : NULL;
+    int ib,ii;
+
+#pragma omp for schedule(dynamic)
+    for (ib=0; ib<nblocks; ib++) {
+      int p0 = ib*nb;
+      int ni = (p0+nb > np) ? np-p0 : nb;
+      SeedTiles(pmat,nsubjects,p0,ni,T);
+
+      for (ii=0; ii<ni; ii++) {
+	p = p0+ii;
+	for (s=0; s<nsubjects; s++) {
+	  const float *corr = &T[((size_t)s*ni+ii)*np];
+	  k = 0;
+	  for (j=0; j<np; j++) {
+	    if (j == p) continue;
+	    gsl_matrix_set(data,s,k,(double)corr[j]);
+	    k++;
+	  }
+	}
+	ccm[p] = Concordance(data,np-1,type,otype,kwork,owork);
+      }
+    }
+    VKendallFree(kwork);
+    VOCCCFree(owork);
+    gsl_matrix_free(data);
+    VFree(T);
+  }
+
+  if (project) {
+    for (i=0; i<nvoxels; i++) {
+      if (parcel[i] < 0) continue;
+      b = VPixel(map,0,0,i,VShort);
+      r = VPixel(map,0,1,i,VShort);
+      c = VPixel(map,0,2,i,VShort);
+      VPixel(dest,b,r,c,VFloat) = ccm[parcel[i]];
+    }
+  }
+  else {
+    dest = VCreateImage(1,2,np,VFloatRepn);
+    VSetAttr(VImageAttrList(dest),"modality",NULL,VStringRepn,"parcels");
+    for (p=0; p<np; p++) {
+      VPixel(dest,0,0,p,VFloat) = (float)labels[p];
+      VPixel(dest,0,1,p,VFloat) = ccm[p];
+    }
+  }
+
+  for (s=0; s<nsubjects; s++) gsl_matrix_float_free(pmat[s]);
+  VFree(pmat);
+  VFree(ccm);
+  VFree(parcel);
+  VFree(labels);
+  return dest;
 }
 
 
 VImage
-VCCM(VImage **src, VImage mask, int nsubjects, int nslices,int first,int length,int type,int otype,VShort minval)
+VCCM(VImage **src, VImage mask, int nsubjects, int nslices,int first,int length,int type,int otype,VShort minval,
+     VImage atlas,VBoolean project)
 {
   VImage map=NULL,dest=NULL;
-  int i,j,k,s,nvoxels,nt,len,last,b,r,c,bb,rr,cc,rad2,nrows,ncols;
-  double u=0,v=0;
-  gsl_matrix *data=NULL;
+  int i,j,k,s,nvoxels,nt,len,last,b,r,c,rad2,nrows,ncols,progress;
   gsl_matrix_float **mat=NULL;
 
 
@@ -94,9 +429,10 @@ VCCM(VImage **src, VImage mask, int nsubjects, int nslices,int first,int length,
 	if (VImageNColumns(src[s][b]) != ncols) 
 	  VError(" inconsistent image dimensions, subj %d, ncols %d %d",s,ncols,VImageNColumns(src[s][b])); 
 	*/
+	if (VPixelRepn(src[s][b]) == VFloatRepn && minval == 0) continue;
 	for (r=0; r<nrows; r++) {
 	  for (c=0; c<ncols; c++) {
-	    if (VPixel(src[s][b],0,r,c,VShort) < minval) VSetPixel(mask,b,r,c,0);
+	    if (VGetPixel(src[s][b],0,r,c) < minval) VSetPixel(mask,b,r,c,0);
 	  }
 	}
       }
@@ -170,26 +506,15 @@ VCCM(VImage **src, VImage mask, int nsubjects, int nslices,int first,int length,
 
 
   /*
-  ** avoid casting to float, copy data to matrix
-  */  
+  ** copy data to matrix
+  */
   mat = (gsl_matrix_float **) VCalloc(nsubjects,sizeof(gsl_matrix_float *));
   if (!mat) VError(" err allocating mat");
 
   for (s=0; s<nsubjects; s++) {
     mat[s] = gsl_matrix_float_calloc(nvoxels,nt);
     if (!mat[s]) VError(" err allocating mat[s]");
-
-    for (i=0; i<nvoxels; i++) {      
-      b = VPixel(map,0,0,i,VShort);
-      r = VPixel(map,0,1,i,VShort);
-      c = VPixel(map,0,2,i,VShort);
-
-      float *ptr = gsl_matrix_float_ptr(mat[s],i,0);
-      int k;
-      for (k=first; k<=last; k++) {
-	*ptr++ = (float) VPixel(src[s][b],k,r,c,VShort);
-      }
-    }
+    LoadTimeSeries(src[s],map,first,last,mat[s]);
   }
 
   /*
@@ -202,52 +527,75 @@ VCCM(VImage **src, VImage mask, int nsubjects, int nslices,int first,int length,
 
 
   /*
-  ** get correlation maps 
+  ** parcel-level CCM
   */
-  data = gsl_matrix_calloc(nsubjects,nvoxels);
+  if (atlas != NULL)
+    return ParcelCCM(mat,map,atlas,project,dest,nsubjects,nvoxels,nt,type,otype);
 
+  /* normalize once, correlations are then plain dot products */
+  for (s=0; s<nsubjects; s++) {
+    for (i=0; i<nvoxels; i++) VCorrNormalize(gsl_matrix_float_ptr(mat[s],i,0),nt);
+  }
+
+
+  /*
+  ** get correlation maps 
+  */
   rad2 = 3*9;
-  for (i=0; i<nvoxels; i++) {
-    if (i%10 == 0) fprintf(stderr," i: %7d\r",i);
-    b = VPixel(map,0,0,i,VShort);
-    r = VPixel(map,0,1,i,VShort);
-    c = VPixel(map,0,2,i,VShort);
-        
-    len = 0;
-    for (s=0; s<nsubjects; s++) {
-      const float *arr1 = gsl_matrix_float_ptr(mat[s],i,0);
-
-      k = 0;
-      for (j=0; j<nvoxels; j++) {
-	if (i == j) continue;
-	bb = VPixel(map,0,0,j,VShort);
-	rr = VPixel(map,0,1,j,VShort);
-	cc = VPixel(map,0,2,j,VShort);
-	/* exclude because of spatial smoothness: */
-	if ((SQR(b-bb) + SQR(r-rr) + SQR(c-cc)) < rad2) continue; 
-
-	const float *arr2 = gsl_matrix_float_ptr(mat[s],j,0);
-	u = Correlation(arr1,arr2,nt);
-
-	gsl_matrix_set(data,s,k,(double)u);
-	k++;
+  progress = 0;
+  VoxelGrid *grid = VoxelGridCreate(map,nslices,nrows,ncols,rad2);
+
+  int nb = SeedBlockSize(nsubjects,nvoxels);
+  int nblocks = (nvoxels+nb-1)/nb;
+
+#pragma omp parallel private(i,j,k,s,len)
+  {
+    gsl_matrix *data = gsl_matrix_calloc(nsubjects,nvoxels);
+    float *T = (float *) VCalloc((size_t)nsubjects*nb*nvoxels,sizeof(float));
+    int *excl = (int *) VCalloc(grid->noff+1,sizeof(int));
+    KendallWork *kwork = (type == 0) ? VKendallWorkspace(nsubjects,nvoxels) : NULL;
+    OCCCWork *owork = (type == 1) ? VOCCCWorkspace(nsubjects) : NULL;
+    int ib,ii,e,nex;
+
+#pragma omp for schedule(dynamic)
+    for (ib=0; ib<nblocks; ib++) {
+      int i0 = ib*nb;
+      int ni = (i0+nb > nvoxels) ? nvoxels-i0 : nb;
+      SeedTiles(mat,nsubjects,i0,ni,T);
+
+      for (ii=0; ii<ni; ii++) {
+	i = i0+ii;
+
+	/* exclude neighbours because of spatial smoothness, copy the segments in between */
+	nex = ExcludedVoxels(grid,i,excl);
+	excl[nex] = nvoxels;
+
+	len = 0;
+	for (s=0; s<nsubjects; s++) {
+	  const float *corr = &T[((size_t)s*ni+ii)*nvoxels];
+	  double *x = gsl_matrix_ptr(data,s,0);
+	  k = j = 0;
+	  for (e=0; e<=nex; e++) {
+	    for (; j<excl[e]; j++) x[k++] = (double)corr[j];
+	    j++;
+	  }
+	  len = k;
+	}
+	if (len >= data->size2) VError(" len= %d %d",len,data->size2);
+
+	VPixel(dest,grid->b[i],grid->r[i],grid->c[i],VFloat) = Concordance(data,len,type,otype,kwork,owork);
       }
-      len = k;
+#pragma omp atomic
+      progress += ni;
+      fprintf(stderr," i: %7d\r",progress);
     }
-    if (len >= data->size2) VError(" len= %d %d",len,data->size2);
-
-    if (type == 0)
-      v = VKendall_W(data,len,otype);
-    else if (type == 1)
-      v = VOCCC(data,len,verbose);
-    else
-      VError(" illegal type");
-
-    b = VPixel(map,0,0,i,VShort);
-    r = VPixel(map,0,1,i,VShort);
-    c = VPixel(map,0,2,i,VShort);
-    VPixel(dest,b,r,c,VFloat) = v;
+    VKendallFree(kwork);
+    VOCCCFree(owork);
+    gsl_matrix_free(data);
+    VFree(excl);
+    VFree(T);
   }
+  VoxelGridFree(grid);
   fprintf(stderr,"\n");
   return dest;
 }
@@ -263,6 +611,9 @@ int main (int argc, char *argv[])
   static VShort first  = 2;
   static VShort length = 0;
   static VShort minval = 0;
+  static VString atlas_filename = "";
+  static VBoolean project = TRUE;
+  static VShort nproc = 0;
   static VOptionDescRec options[] = {
     {"in", VStringRepn, 0, & in_files, VRequiredOpt, NULL,"Input files" },
     {"mask",VStringRepn,1,(VPointer) &mask_filename,VRequiredOpt,NULL,"mask file"},   
@@ -272,6 +623,9 @@ int main (int argc, char *argv[])
     {"type",VShortRepn,1,(VPointer) &type,VOptionalOpt,TypeDict,"type"},
     {"gauss",VShortRepn,1,(VPointer) &otype,VOptionalOpt,NULL,"use gaussian version of kendall"},
     {"minval",VShortRepn,1,(VPointer) &minval,VOptionalOpt,NULL,"signal threshold"},
+    {"atlas",VStringRepn,1,(VPointer) &atlas_filename,VOptionalOpt,NULL,"label image, CCM is computed on the mean time series of each label"},
+    {"project",VBooleanRepn,1,(VPointer) &project,VOptionalOpt,NULL,"project parcel values to voxels, otherwise write a table of labels and values"},
+    {"j",VShortRepn,1,(VPointer) &nproc,VOptionalOpt,NULL,"number of processors to use, '0' to use all"},
     {"out", VStringRepn, 1, & out_filename, VRequiredOpt, NULL,"Output file" }
   };
   FILE *fp=NULL,*fpo=NULL;
@@ -297,6 +651,15 @@ int main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+
+  /* omp-stuff */
+#ifdef _OPENMP
+  int num_procs=omp_get_num_procs();
+  if (nproc > 0 && nproc < num_procs) num_procs = nproc;
+  fprintf(stderr,"# using %d cores\n",(int)num_procs);
+  omp_set_num_threads(num_procs);
+#endif /* _OPENMP */
+
   
   /*
   ** read mask
@@ -317,6 +680,27 @@ int main (int argc, char *argv[])
   if (mask == NULL) VError(" no mask found");
 
 
+  /*
+  ** read label atlas
+  */
+  VImage atlas=NULL;
+  if (strlen(atlas_filename) > 1) {
+    fp = VOpenInputFile (atlas_filename, TRUE);
+    list1 = VReadFile (fp, NULL);
+    if (! list1) VError("Error reading atlas file");
+    fclose(fp);
+    for (VFirstAttr (list1, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
+      if (VGetAttrRepn (& posn) != VImageRepn) continue;
+      VGetAttrValue (& posn, NULL,VImageRepn, & atlas);
+      break;
+    }
+    if (atlas == NULL) VError(" no atlas found");
+    if (VImageNBands(atlas) != VImageNBands(mask) || VImageNRows(atlas) != VImageNRows(mask)
+	|| VImageNColumns(atlas) != VImageNColumns(mask))
+      VError(" atlas and mask have different dimensions");
+  }
+
+
 
   /* 
   ** read images  
@@ -336,13 +720,17 @@ int main (int argc, char *argv[])
 
     if (geolist == NULL) geolist = VGetGeoInfo(list);
 
+    /* the first image of a supported type defines the pixel type of the data */
+    VRepnKind repn = VUnknownRepn;
     j=0;
     for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
       if (VGetAttrRepn (& posn) != VImageRepn) continue;
       VGetAttrValue (& posn, NULL, VImageRepn, & xsrc);
-      if (VPixelRepn(xsrc) != VShortRepn) continue;
+      if (repn == VUnknownRepn && DataRepn(VPixelRepn(xsrc))) repn = VPixelRepn(xsrc);
+      if (VPixelRepn(xsrc) != repn) continue;
       j++;
     }
+    if (repn == VUnknownRepn) VError(" no short, float or ubyte images in %s",in_filename);
     if (i == 0) nslices = j;
     else if (j != nslices) VError(" inconsistent number of slices %d %d",j,nslices);
 
@@ -351,7 +739,7 @@ int main (int argc, char *argv[])
     for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
       if (VGetAttrRepn (& posn) != VImageRepn) continue;
       VGetAttrValue (& posn, NULL, VImageRepn, & xsrc);
-      if (VPixelRepn(xsrc) != VShortRepn) continue;
+      if (VPixelRepn(xsrc) != repn) continue;
       if (i >= nsubjects || j >= nslices) VError(" i,j= %d %d",i,j);
       src[i][j] = xsrc;
       j++;
@@ -362,18 +750,25 @@ int main (int argc, char *argv[])
   /*
   ** do CCM
   */
-  dest = VCCM(src,mask,nsubjects,nslices,(int)first,(int)length,(int)type,(int)otype,minval);
+  dest = VCCM(src,mask,nsubjects,nslices,(int)first,(int)length,(int)type,(int)otype,minval,atlas,project);
 
 
   /* invert to get discordant map */
   disc = VCreateImageLike(dest);
   VFillImage(disc,VAllBands,0);
-  for (b=0; b<VImageNBands(dest); b++) {
-    for (r=0; r<VImageNRows(dest); r++) {
-      for (c=0; c<VImageNColumns(dest); c++) {
-        if (VGetPixel(mask,b,r,c) < 1) continue;
-        u = VPixel(dest,b,r,c,VFloat);
-        VPixel(disc,b,r,c,VFloat) = 1-u;
+  if (atlas != NULL && !project) {
+    VCopyImagePixels(dest,disc,VAllBands);
+    for (c=0; c<VImageNColumns(dest); c++) VPixel(disc,0,1,c,VFloat) = 1-VPixel(dest,0,1,c,VFloat);
+  }
+  else {
+    for (b=0; b<VImageNBands(dest); b++) {
+      for (r=0; r<VImageNRows(dest); r++) {
+	for (c=0; c<VImageNColumns(dest); c++) {
+	  if (VGetPixel(mask,b,r,c) < 1) continue;
+	  if (atlas != NULL && VGetPixel(atlas,b,r,c) < 0.5) continue;
+	  u = VPixel(dest,b,r,c,VFloat);
+	  VPixel(disc,b,r,c,VFloat) = 1-u;
+	}
       }
     }
   }
@@ -383,7 +778,7 @@ int main (int argc, char *argv[])
   ** output
   */
   out_list = VCreateAttrList();
-  if (geolist != NULL) {
+  if (geolist != NULL && (atlas == NULL || project)) {
     double *D = VGetGeoDim(geolist,NULL);
     D[0] = 3;  /* 3D */
     D[4] = 1;  /* just one timestep */
@@ -0,0 +1,141 @@
+/*
+** ECM - parcel-level connectivity using a label atlas.
+** Time series are averaged within each label, ECM is then computed
+** on the parcel x parcel matrix.
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/VImage.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vecm.h"
+
+
+int CompareInt(const void *a,const void *b)
+{
+  int u = *(const int *)a;
+  int v = *(const int *)b;
+  if (u < v) return -1;
+  if (u > v) return 1;
+  return 0;
+}
+
+
+/*
+** parcel index of each voxel of the map, -1 for voxels without label.
+** Labels are positive integers, parcels are numbered in ascending label order.
+*/
+ECMAtlas *ParcelMap(VImage atlas,VImage map,VBoolean project)
+{
+  size_t i,k,n = VImageNColumns(map);
+  int b,r,c,l;
+  ECMAtlas *A = (ECMAtlas *) VCalloc(1,sizeof(ECMAtlas));
+
+  A->project = project;
+  A->parcel = (int *) VCalloc(n,sizeof(int));
+  int *lab = (int *) VCalloc(n,sizeof(int));
+
+  k = 0;
+  for (i=0; i<n; i++) {
+    b = VPixel(map,0,0,i,VFloat);
+    r = VPixel(map,0,1,i,VFloat);
+    c = VPixel(map,0,2,i,VFloat);
+    l = (int)(VGetPixel(atlas,b,r,c) + 0.5);
+    A->parcel[i] = l;
+    if (l > 0) lab[k++] = l;
+  }
+
+  /* distinct labels */
+  qsort(lab,k,sizeof(int),CompareInt);
+  A->nparcels = 0;
+  for (i=0; i<k; i++) {
+    if (i == 0 || lab[i] != lab[i-1]) lab[A->nparcels++] = lab[i];
+  }
+  if (A->nparcels < 2) VError(" atlas has less than two labels inside the mask");
+  A->labels = (int *) VCalloc(A->nparcels,sizeof(int));
+  memcpy(A->labels,lab,A->nparcels*sizeof(int));
+  VFree(lab);
+
+  for (i=0; i<n; i++) {
+    l = A->parcel[i];
+    if (l < 1) {
+      A->parcel[i] = -1;
+      continue;
+    }
+    int *p = (int *) bsearch(&l,A->labels,A->nparcels,sizeof(int),CompareInt);
+    A->parcel[i] = (int)(p - A->labels);
+  }
+  fprintf(stderr," atlas: %ld parcels\n",(long)A->nparcels);
+  return A;
+}
+
+
+/* average time series within parcels, P is nparcels x nt */
+void ParcelTimeSeries(ECMAtlas *A,const gsl_matrix_float *X,gsl_matrix_float *P)
+{
+  size_t i,k,p,nt = X->size2;
+  double *sum = (double *) VCalloc(A->nparcels*nt,sizeof(double));
+  int *count = (int *) VCalloc(A->nparcels,sizeof(int));
+
+  for (i=0; i<X->size1; i++) {
+    if (A->parcel[i] < 0) continue;
+    p = (size_t)A->parcel[i];
+    const float *x = gsl_matrix_float_const_ptr(X,i,0);
+    double *s = &sum[p*nt];
+    for (k=0; k<nt; k++) s[k] += (double)x[k];
+    count[p]++;
+  }
+
+  for (p=0; p<A->nparcels; p++) {
+    float *y = gsl_matrix_float_ptr(P,p,0);
+    for (k=0; k<nt; k++) y[k] = (float)(sum[p*nt+k]/(double)count[p]);
+  }
+  VFree(sum);
+  VFree(count);
+}
+
+
+/* parcel values to voxels, voxels without label get zero */
+void ParcelToVoxel(ECMAtlas *A,const float *x,float *y,size_t n)
+{
+  size_t i;
+  for (i=0; i<n; i++) y[i] = (A->parcel[i] < 0) ? 0 : x[A->parcel[i]];
+}
+
+
+/* mean of voxel values within parcels */
+void VoxelToParcel(ECMAtlas *A,const float *y,float *x,size_t n)
+{
+  size_t i,p;
+  int *count = (int *) VCalloc(A->nparcels,sizeof(int));
+
+  for (p=0; p<A->nparcels; p++) x[p] = 0;
+  for (i=0; i<n; i++) {
+    if (A->parcel[i] < 0) continue;
+    x[A->parcel[i]] += y[i];
+    count[A->parcel[i]]++;
+  }
+  for (p=0; p<A->nparcels; p++) x[p] /= (float)count[p];
+  VFree(count);
+}
+
+
+/* parcel values as a table, row 0: labels, row 1: values */
+VImage ParcelTable(ECMAtlas *A,const float *x)
+{
+  size_t p;
+  VImage dest = VCreateImage(1,2,A->nparcels,VFloatRepn);
+  VSetAttr(VImageAttrList(dest),"modality",NULL,VStringRepn,"parcels");
+  for (p=0; p<A->nparcels; p++) {
+    VPixel(dest,0,0,p,VFloat) = (float)A->labels[p];
+    VPixel(dest,0,1,p,VFloat) = x[p];
+  }
+  return dest;
+}
@@ -0,0 +1,330 @@
+/*
+** ECM - eigenvector of the largest eigenvalue of the similarity matrix
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_eigen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+#define SQR(x) ((x) * (x))
+
+
+/*
+** Contributions of the packed rows r0 <= i < r1 to y = Ax.
+** 'A' points to the first element of row r0.
+** Rows are split into blocks holding equal shares of the triangle.
+** Each thread adds the row sums of its block and the transposed
+** contributions to its own buffer ybuf[id*n ... id*n+n-1].
+*/
+void PackedRowsMatVec(const float *A,size_t r0,size_t r1,const float *x,float *ybuf,size_t n,int nthreads)
+{
+  const size_t a0 = r0*(r0+1)/2;
+  const double s0 = (double)r0*(double)r0;
+  const double s1 = (double)r1*(double)r1;
+
+#pragma omp parallel num_threads(nthreads)
+  {
+    int id=0;
+#ifdef _OPENMP
+    id = omp_get_thread_num();
+#endif
+    size_t i0 = (size_t)sqrt(s0 + (s1-s0)*(double)id/(double)nthreads);
+    size_t i1 = (size_t)sqrt(s0 + (s1-s0)*(double)(id+1)/(double)nthreads);
+    if (id == 0) i0 = r0;
+    if (id == nthreads-1) i1 = r1;
+    float *yt = &ybuf[(size_t)id*n];
+    size_t ii,j;
+
+    for (ii=i0; ii<i1; ii++) {
+      const float *a = &A[ii*(ii+1)/2 - a0];
+      const float xi = x[ii];
+      float sum = a[ii]*xi;
+
+#pragma omp simd reduction(+:sum)
+      for (j=0; j<ii; j++) sum += a[j]*x[j];
+      yt[ii] += sum;
+
+#pragma omp simd
+      for (j=0; j<ii; j++) yt[j] += a[j]*xi;
+    }
+  }
+}
+
+
+/* y = sum of the per-thread buffers */
+void ReduceThreadBuffers(const float *ybuf,float *y,size_t n,int nthreads)
+{
+  size_t i;
+  int k;
+
+#pragma omp parallel for private(k) schedule(static)
+  for (i=0; i<n; i++) {
+    float sum=0;
+    for (k=0; k<nthreads; k++) sum += ybuf[(size_t)k*n+i];
+    y[i] = sum;
+  }
+}
+
+
+/* y = Ax, A symmetric and stored as packed lower triangle */
+void PackedMatVec(float *A,const float *x,float *y,size_t n)
+{
+  int nthreads=1;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  if ((size_t)nthreads > n) nthreads = (int)n;
+  float *ybuf = (float *) VCalloc((size_t)nthreads*n,sizeof(float));
+  PackedRowsMatVec(A,0,n,x,ybuf,n,nthreads);
+  ReduceThreadBuffers(ybuf,y,n,nthreads);
+  VFree(ybuf);
+}
+
+
+/* y = Ax */
+void VMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  if (M->mode == ECM_MATRIXFREE)
+    MatrixFreeMatVec(M,x,y);
+  else if (M->mode == ECM_OUTOFCORE)
+    OutOfCoreMatVec(M,x,y);
+  else if (M->mode == ECM_SPARSE)
+    SparseMatVec(M,x,y);
+  else
+    PackedMatVec(M->A,x,y,M->n);
+}
+
+
+double VDot(const float *x,const float *y,size_t n)
+{
+  size_t i;
+  double sum=0;
+#pragma omp parallel for reduction(+:sum) schedule(static)
+  for (i=0; i<n; i++) sum += (double)x[i]*(double)y[i];
+  return sum;
+}
+
+
+/* y = y + a*x */
+void VAxpy(double a,const float *x,float *y,size_t n)
+{
+  size_t i;
+#pragma omp parallel for schedule(static)
+  for (i=0; i<n; i++) y[i] += (float)(a*(double)x[i]);
+}
+
+
+/* ||Ax - lambda x||, x of unit length, y = Ax */
+double VResidual(const float *x,const float *y,double lambda,size_t n)
+{
+  size_t i;
+  double sum=0;
+#pragma omp parallel for reduction(+:sum) schedule(static)
+  for (i=0; i<n; i++) sum += SQR((double)y[i] - lambda*(double)x[i]);
+  return sqrt(sum);
+}
+
+
+/* plain power iteration */
+void PowerIteration(ECMMatrix *M,float *ev,int maxiter)
+{
+  size_t i,n=M->n;
+  int iter;
+  double sum,d,lambda,res;
+  float *y = (float *) VCalloc(n,sizeof(float));
+
+  fprintf(stderr," power iteration...\n");
+  for (iter=0; iter < maxiter; iter++) {
+
+    VMatVec(M,ev,y);
+    lambda = VDot(ev,y,n);
+    res = VResidual(ev,y,lambda,n);
+
+    sum = sqrt(VDot(y,y,n));
+    d = 0;
+    for (i=0; i<n; i++) {
+      d += SQR(ev[i] - y[i]/sum);
+      ev[i] = y[i]/sum;
+    }
+    fprintf(stderr," %5d  %f   lambda: %f, residual: %e\n",(int)iter,d,lambda,res);
+    if (d < 1.0e-6) break;
+  }
+  VFree(y);
+}
+
+
+/* largest eigenpair of the k x k tridiagonal matrix with diagonal a, off-diagonal b */
+double TridiagEigen(double *a,double *b,int k,double *x)
+{
+  int i;
+  gsl_matrix *T = gsl_matrix_calloc(k,k);
+  gsl_matrix *S = gsl_matrix_calloc(k,k);
+  gsl_vector *eval = gsl_vector_calloc(k);
+  gsl_eigen_symmv_workspace *workspace = gsl_eigen_symmv_alloc(k);
+
+  for (i=0; i<k; i++) {
+    gsl_matrix_set(T,i,i,a[i]);
+    if (i+1 < k) {
+      gsl_matrix_set(T,i,i+1,b[i]);
+      gsl_matrix_set(T,i+1,i,b[i]);
+    }
+  }
+  gsl_eigen_symmv(T,eval,S,workspace);
+  gsl_eigen_symmv_sort(eval,S,GSL_EIGEN_SORT_VAL_DESC);
+  double lambda = gsl_vector_get(eval,0);
+  for (i=0; i<k; i++) x[i] = gsl_matrix_get(S,i,0);
+
+  gsl_eigen_symmv_free(workspace);
+  gsl_vector_free(eval);
+  gsl_matrix_free(T);
+  gsl_matrix_free(S);
+  return lambda;
+}
+
+
+/*
+** Lanczos iteration with full reorthogonalization,
+** restarted from the current Ritz vector every 'm' steps.
+*/
+void Lanczos(ECMMatrix *M,float *ev,int maxiter)
+{
+  size_t i,n=M->n;
+  int j,k,kmax,iter=0,restart=0;
+  VBoolean have_w=FALSE;
+  int m=20;
+  double alpha,beta,lambda=0,res=0,s=0;
+  double tol=1.0e-5;
+
+  if ((size_t)m > n-1) m = (int)n-1;
+  if (m < 2) {
+    PowerIteration(M,ev,maxiter);
+    return;
+  }
+
+  float *V = (float *) VCalloc((size_t)(m+1)*n,sizeof(float));
+  float *w = (float *) VCalloc(n,sizeof(float));
+  double *a = (double *) VCalloc(m,sizeof(double));
+  double *b = (double *) VCalloc(m,sizeof(double));
+  double *x = (double *) VCalloc(m,sizeof(double));
+
+  fprintf(stderr," Lanczos iteration...\n");
+  while (iter < maxiter) {
+
+    /* start vector */
+    s = 1.0/sqrt(VDot(ev,ev,n));
+    for (i=0; i<n; i++) V[i] = (float)(s*(double)ev[i]);
+
+    /* Lanczos steps */
+    kmax = m;
+    for (k=0; k<m; k++) {
+      float *vk = &V[(size_t)k*n];
+      if (k > 0 || have_w == FALSE) {
+	VMatVec(M,vk,w);
+	iter++;
+      }
+
+      alpha = VDot(vk,w,n);
+      a[k] = alpha;
+
+      /* full reorthogonalization, twice is enough */
+      int pass;
+      for (pass=0; pass<2; pass++) {
+	for (j=0; j<=k; j++) {
+	  float *vj = &V[(size_t)j*n];
+	  VAxpy(-VDot(vj,w,n),vj,w,n);
+	}
+      }
+      beta = sqrt(VDot(w,w,n));
+      b[k] = beta;
+      if (beta < 1.0e-10*fabs(alpha)) {  /* invariant subspace found */
+	kmax = k+1;
+	break;
+      }
+
+      /* Ritz estimate of the residual, beta_k |x_k| */
+      if (k > 0) {
+	lambda = TridiagEigen(a,b,k+1,x);
+	if (beta*fabs(x[k]) < 0.1*tol*fabs(lambda)) {
+	  kmax = k+1;
+	  break;
+	}
+      }
+      float *vk1 = &V[(size_t)(k+1)*n];
+      for (i=0; i<n; i++) vk1[i] = (float)((double)w[i]/beta);
+    }
+
+    /* Ritz vector */
+    lambda = TridiagEigen(a,b,kmax,x);
+    memset(ev,0,n*sizeof(float));
+    for (k=0; k<kmax; k++) VAxpy(x[k],&V[(size_t)k*n],ev,n);
+
+    /* true residual, Aw is re-used as first step of the next restart */
+    s = 1.0/sqrt(VDot(ev,ev,n));
+    for (i=0; i<n; i++) ev[i] = (float)(s*(double)ev[i]);
+    VMatVec(M,ev,w);
+    iter++;
+    have_w = TRUE;
+    lambda = VDot(ev,w,n);
+    res = VResidual(ev,w,lambda,n);
+    fprintf(stderr," %5d  restart %3d   lambda: %f, residual: %e\n",iter,restart,lambda,res);
+    restart++;
+    if (res < tol*fabs(lambda)) break;
+  }
+
+  /* Perron vector is non-negative */
+  double sum=0;
+  for (i=0; i<n; i++) sum += ev[i];
+  if (sum < 0) {
+    for (i=0; i<n; i++) ev[i] = -ev[i];
+  }
+
+  VFree(a);
+  VFree(b);
+  VFree(x);
+  VFree(w);
+  VFree(V);
+}
+
+
+/*
+** eigenvector centrality, 'ev' is used as start vector if 'warmstart' is set
+*/
+void EigenvectorCentrality(ECMMatrix *M,float *ev,int solver,VBoolean warmstart)
+{
+  size_t i,n=M->n;
+  double nx;
+
+  /* start vector */
+  if (warmstart) {
+    nx = sqrt(VDot(ev,ev,n));
+    if (nx < 1.0e-10) warmstart = FALSE;
+    else for (i=0; i<n; i++) ev[i] /= nx;
+  }
+  if (!warmstart) {
+    nx = sqrt((double)n);
+    for (i=0; i<n; i++) ev[i] = 1.0/nx;
+  }
+
+  if (solver == 1)
+    Lanczos(M,ev,(int)200);
+  else
+    PowerIteration(M,ev,(int)50);
+
+  for (i=0; i<n; i++) ev[i] *= 100.0;
+  fprintf(stderr," ecm done..\n");
+}
@@ -0,0 +1,185 @@
+/*
+** ECM - matrix-free product of the similarity matrix with a vector.
+** The n x n matrix is never stored, only the normalized time series are kept,
+** so that memory is O(n*nt) instead of O(n*n).
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_cblas.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+/*
+** type 'add':  A = 1 1^T + Z Z^T  with zero diagonal,
+** a rank-nt update of the all-ones matrix.
+*/
+void RankUpdateMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  size_t i,k,n=M->n;
+  gsl_matrix_float *Z = M->Z;
+  size_t nt = Z->size2;
+  double s=0;
+  double *w = (double *) VCalloc(nt,sizeof(double));
+
+  for (i=0; i<n; i++) s += (double)x[i];
+
+  /* w = Z^T x */
+#pragma omp parallel private(i,k)
+  {
+    double *wt = (double *) VCalloc(nt,sizeof(double));
+#pragma omp for schedule(static)
+    for (i=0; i<n; i++) {
+      const float *z = gsl_matrix_float_const_ptr(Z,i,0);
+      const double xi = (double)x[i];
+      for (k=0; k<nt; k++) wt[k] += xi*(double)z[k];
+    }
+#pragma omp critical
+    {
+      for (k=0; k<nt; k++) w[k] += wt[k];
+    }
+    VFree(wt);
+  }
+
+  /* y = 1 s + Z w - diag */
+#pragma omp parallel for private(k) schedule(static)
+  for (i=0; i<n; i++) {
+    const float *z = gsl_matrix_float_const_ptr(Z,i,0);
+    double zw=0,zz=0;
+    for (k=0; k<nt; k++) {
+      zw += (double)z[k]*w[k];
+      zz += (double)z[k]*(double)z[k];
+    }
+    y[i] = (float)(s + zw - (double)x[i]*(1.0 + zz));
+  }
+  VFree(w);
+}
+
+
+/*
+** all other types: tile-by-tile over the lower triangle.
+** Each tile contributes to both its rows and its columns,
+** column contributions are collected in per-thread buffers.
+*/
+void TileMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  size_t n=M->n;
+  size_t nblocks = (n+NBLOCK-1)/NBLOCK;
+  int nthreads=1;
+  size_t bi;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  float *ybuf = (float *) VCalloc((size_t)nthreads*n,sizeof(float));
+
+#pragma omp parallel
+  {
+    int id=0;
+#ifdef _OPENMP
+    id = omp_get_thread_num();
+#endif
+    float *yt = &ybuf[(size_t)id*n];
+    float *T = (float *) VCalloc(NBLOCK*NBLOCK,sizeof(float));
+    size_t bj,i,j;
+
+#pragma omp for schedule(dynamic)
+    for (bi=0; bi<nblocks; bi++) {
+      size_t i0 = bi*NBLOCK;
+      size_t ni = (i0+NBLOCK > n) ? n-i0 : NBLOCK;
+
+      for (bj=0; bj<=bi; bj++) {
+	size_t j0 = bj*NBLOCK;
+	size_t nj = (j0+NBLOCK > n) ? n-j0 : NBLOCK;
+	SimilarityTile(M->Z,i0,ni,j0,nj,M->type,T);
+
+	for (i=0; i<ni; i++) {
+	  const float *t = &T[i*nj];
+	  float sum=0;
+	  for (j=0; j<nj; j++) sum += t[j]*x[j0+j];
+	  yt[i0+i] += sum;
+	}
+	if (bj == bi) continue;
+
+	for (i=0; i<ni; i++) {
+	  const float *t = &T[i*nj];
+	  const float xi = x[i0+i];
+	  for (j=0; j<nj; j++) yt[j0+j] += t[j]*xi;
+	}
+      }
+    }
+    VFree(T);
+  }
+
+  /* sum up per-thread buffers */
+  size_t i;
+  int k;
+#pragma omp parallel for private(k) schedule(static)
+  for (i=0; i<n; i++) {
+    float sum=0;
+    for (k=0; k<nthreads; k++) sum += ybuf[(size_t)k*n+i];
+    y[i] = sum;
+  }
+  VFree(ybuf);
+}
+
+
+/* strength and degree, one extra pass over all tiles */
+void MatrixFreeDegree(ECMMatrix *M)
+{
+  size_t n=M->n;
+  size_t nblocks = (n+NBLOCK-1)/NBLOCK;
+  int nthreads=1;
+  size_t bi;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  double *dbuf = DegreeBuffers(M,nthreads);
+  if (dbuf == NULL) return;
+
+#pragma omp parallel
+  {
+    int id=0;
+#ifdef _OPENMP
+    id = omp_get_thread_num();
+#endif
+    float *T = (float *) VCalloc(NBLOCK*NBLOCK,sizeof(float));
+    size_t bj;
+
+#pragma omp for schedule(dynamic)
+    for (bi=0; bi<nblocks; bi++) {
+      size_t i0 = bi*NBLOCK;
+      size_t ni = (i0+NBLOCK > n) ? n-i0 : NBLOCK;
+      for (bj=0; bj<=bi; bj++) {
+	size_t j0 = bj*NBLOCK;
+	size_t nj = (j0+NBLOCK > n) ? n-j0 : NBLOCK;
+	SimilarityTile(M->Z,i0,ni,j0,nj,M->type,T);
+	TileDegree(M,T,i0,ni,j0,nj,&dbuf[(size_t)id*2*n]);
+      }
+    }
+    VFree(T);
+  }
+  DegreeReduce(M,dbuf,nthreads);
+}
+
+
+/* y = Ax */
+void MatrixFreeMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  if (M->type == 1)
+    RankUpdateMatVec(M,x,y);
+  else
+    TileMatVec(M,x,y);
+}
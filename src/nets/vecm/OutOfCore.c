@@ -0,0 +1,227 @@
+/*
+** ECM - out-of-core storage of the similarity matrix.
+** The packed lower triangle is written to a memory-mapped scratch file
+** and streamed window by window, so that only a bounded amount of
+** main memory is needed regardless of the number of voxels.
+*/
+#define _GNU_SOURCE
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+
+/* a window of rows r0 <= i < r1 mapped into memory */
+typedef struct WindowStruct {
+  void  *addr;      /* page-aligned start of the mapping */
+  size_t len;       /* length of the mapping */
+  float *A;         /* first element of row r0 */
+} Window;
+
+
+void MapWindow(ECMMatrix *M,size_t w,int prot,Window *win)
+{
+  size_t r0 = M->wrow[w];
+  size_t r1 = M->wrow[w+1];
+  size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t off0 = r0*(r0+1)/2*sizeof(float);
+  size_t off1 = r1*(r1+1)/2*sizeof(float);
+  size_t poff = off0 - off0 % pagesize;
+
+  win->len  = off1 - poff;
+  win->addr = mmap(NULL,win->len,prot,MAP_SHARED,M->fd,(off_t)poff);
+  if (win->addr == MAP_FAILED) VError(" mmap failed: %s",strerror(errno));
+  win->A = (float *)((char *)win->addr + (off0-poff));
+}
+
+
+void UnmapWindow(Window *win)
+{
+  if (win->addr == NULL) return;
+  munmap(win->addr,win->len);
+  win->addr = NULL;
+}
+
+
+/*
+** Split the rows into windows at multiples of NBLOCK such that each window
+** occupies at most half of the memory budget 'tilemem' (in bytes).
+** The other half holds the window that is read ahead.
+** The budget must hold at least two strips of NBLOCK full rows.
+*/
+void OutOfCoreWindows(ECMMatrix *M,size_t tilemem)
+{
+  size_t n = M->n;
+  size_t r0,r1,bytes;
+  size_t minmem = 2*(size_t)NBLOCK*n*sizeof(float);
+
+  if (tilemem < minmem)
+    VError(" tilemem too small for %ld voxels, needs at least %ld MB",
+	   (long)n,(long)((minmem+(1<<20)-1)>>20));
+  M->wrow = (size_t *) VCalloc(n/NBLOCK+2,sizeof(size_t));
+  M->nwin = 0;
+  r0 = 0;
+  while (r0 < n) {
+    r1 = r0;
+    do {
+      r1 = (r1+NBLOCK > n) ? n : r1+NBLOCK;
+      bytes = (r1*(r1+1)/2 - r0*(r0+1)/2)*sizeof(float);
+    } while (r1 < n && bytes + ((r1+NBLOCK)*NBLOCK)*sizeof(float) <= tilemem/2);
+    M->wrow[M->nwin++] = r0;
+    r0 = r1;
+  }
+  M->wrow[M->nwin] = n;
+}
+
+
+/*
+** compute the packed lower triangle window by window and write it
+** to an unlinked scratch file in directory 'scratch'
+*/
+void OutOfCoreMatrix(ECMMatrix *M,const gsl_matrix_float *Z,VString scratch,size_t tilemem)
+{
+  size_t n = M->n;
+  size_t m = n*(n+1)/2;
+  size_t w,progress=0;
+  Window win;
+  char *filename=NULL;
+  int err,nthreads=1;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  double *dbuf = DegreeBuffers(M,nthreads);
+
+  /* the scratch file is re-used for subsequent data sets */
+  if (M->fd < 0) {
+    filename = (char *) VCalloc(strlen(scratch)+32,sizeof(char));
+    sprintf(filename,"%s/vecm_XXXXXX",scratch);
+    M->fd = mkstemp(filename);
+    if (M->fd < 0) VError(" could not create scratch file %s: %s",filename,strerror(errno));
+    unlink(filename);  /* removed automatically when vecm exits */
+
+    err = posix_fallocate(M->fd,0,(off_t)(m*sizeof(float)));
+    if (err != 0) VError(" could not allocate %.2f GB in %s: %s",
+			 (double)(m*sizeof(float))/1.0e9,scratch,strerror(err));
+    VFree(filename);
+
+    OutOfCoreWindows(M,tilemem);
+    fprintf(stderr," out-of-core, scratch: %s, %.2f GB in %ld windows\n",
+	    scratch,(double)(m*sizeof(float))/1.0e9,(long)M->nwin);
+  }
+
+  for (w=0; w<M->nwin; w++) {
+    size_t r0 = M->wrow[w];
+    size_t r1 = M->wrow[w+1];
+    size_t a0 = r0*(r0+1)/2;
+    size_t b0 = r0/NBLOCK;
+    size_t b1 = (r1+NBLOCK-1)/NBLOCK;
+    size_t bi,ntiles=0;
+    long t;
+
+    MapWindow(M,w,PROT_READ | PROT_WRITE,&win);
+    for (bi=b0; bi<b1; bi++) ntiles += bi+1;
+
+#pragma omp parallel
+    {
+      float *T = (float *) VCalloc(NBLOCK*NBLOCK,sizeof(float));
+      size_t bb,bj,i,j;
+      int id=0;
+#ifdef _OPENMP
+      id = omp_get_thread_num();
+#endif
+
+#pragma omp for schedule(dynamic)
+      for (t=0; t<(long)ntiles; t++) {
+
+	/* tile t -> (block row bb, block column bj) */
+	bj = (size_t)t;
+	for (bb=b0; bj > bb; bb++) bj -= bb+1;
+
+	size_t i0 = bb*NBLOCK;
+	size_t ni = (i0+NBLOCK > n) ? n-i0 : NBLOCK;
+	size_t j0 = bj*NBLOCK;
+	size_t nj = (j0+NBLOCK > n) ? n-j0 : NBLOCK;
+	SimilarityTile(Z,i0,ni,j0,nj,M->type,T);
+	if (dbuf) TileDegree(M,T,i0,ni,j0,nj,&dbuf[(size_t)id*2*n]);
+
+	for (i=0; i<ni; i++) {
+	  const size_t ii = i0+i;
+	  const float *tt = &T[i*nj];
+	  float *a = &win.A[ii*(ii+1)/2 - a0 + j0];
+	  size_t jmax = (bj == bb) ? i+1 : nj;
+	  for (j=0; j<jmax; j++) a[j] = tt[j];
+	}
+      }
+      VFree(T);
+    }
+    UnmapWindow(&win);
+    progress++;
+    fprintf(stderr," %5ld of %ld\r",(long)progress,(long)M->nwin);
+  }
+  fprintf(stderr,"\n");
+  DegreeReduce(M,dbuf,nthreads);
+}
+
+
+/*
+** y = Ax, streaming the windows sequentially.
+** While one window is processed, the kernel reads the next one ahead.
+*/
+void OutOfCoreMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  size_t n = M->n;
+  size_t w;
+  int nthreads=1;
+  Window cur,next;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  if ((size_t)nthreads > n) nthreads = (int)n;
+  float *ybuf = (float *) VCalloc((size_t)nthreads*n,sizeof(float));
+
+  next.addr = NULL;
+  MapWindow(M,0,PROT_READ,&cur);
+  madvise(cur.addr,cur.len,MADV_WILLNEED);
+
+  for (w=0; w<M->nwin; w++) {
+    if (w+1 < M->nwin) {
+      MapWindow(M,w+1,PROT_READ,&next);
+      madvise(next.addr,next.len,MADV_WILLNEED);
+    }
+    madvise(cur.addr,cur.len,MADV_SEQUENTIAL);
+    PackedRowsMatVec(cur.A,M->wrow[w],M->wrow[w+1],x,ybuf,n,nthreads);
+    UnmapWindow(&cur);
+    cur = next;
+    next.addr = NULL;
+  }
+  ReduceThreadBuffers(ybuf,y,n,nthreads);
+  VFree(ybuf);
+}
+
+
+void OutOfCoreFree(ECMMatrix *M)
+{
+  close(M->fd);
+  VFree(M->wrow);
+  M->fd = -1;
+  M->wrow = NULL;
+  M->nwin = 0;
+}
@@ -0,0 +1,228 @@
+/*
+** ECM - similarity values computed from normalized time series
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+#include <via/via.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_cblas.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+#define ABS(x) ((x) > 0 ? (x) : -(x))
+
+
+/*
+** center each row and scale it to unit length so that the dot product
+** of two rows equals their linear correlation
+*/
+void VNormalizeRows(gsl_matrix_float *X)
+{
+  size_t i;
+  size_t n  = X->size1;
+  size_t nt = X->size2;
+
+#pragma omp parallel for schedule(static)
+  for (i=0; i<n; i++) VCorrNormalize(gsl_matrix_float_ptr(X,i,0),nt);
+}
+
+
+/* make correlations positive */
+float SimilarityValue(double v,int type)
+{
+  double u=0;
+  double tiny=1.0e-6;
+
+  switch (type) {
+
+  case 0:
+    if (v > tiny) u = v;
+    break;
+
+  case 1:
+    u = v + 1.0f;
+    break;
+
+  case 2:
+    u = ABS(v);
+    break;
+
+  case 3:
+    if (v < -tiny) u = -v;
+    break;
+
+  default:
+    VError(" illegal type");
+  }
+  if (u < tiny) u = tiny;
+  return (float)u;
+}
+
+
+/*
+** ni x nj tile of the similarity matrix starting at (i0,j0), row-major.
+** Z must hold rows normalized by VNormalizeRows.
+** Diagonal elements are zero as in the packed matrix.
+*/
+void SimilarityTile(const gsl_matrix_float *Z,size_t i0,size_t ni,size_t j0,size_t nj,int type,float *T)
+{
+  size_t i,j;
+  const float *Zi = gsl_matrix_float_const_ptr(Z,i0,0);
+  const float *Zj = gsl_matrix_float_const_ptr(Z,j0,0);
+
+  /* diagonal tile: only the lower triangle is needed */
+  if (i0 == j0 && ni == nj) {
+    cblas_ssyrk(CblasRowMajor,CblasLower,CblasNoTrans,(int)ni,(int)Z->size2,
+		1.0f,Zi,(int)Z->tda,0.0f,T,(int)nj);
+    for (i=0; i<ni; i++) {
+      float *t = &T[i*nj];
+      for (j=0; j<i; j++) {
+	t[j] = SimilarityValue((double)t[j],type);
+	T[j*nj+i] = t[j];
+      }
+      t[i] = 0;
+    }
+    return;
+  }
+
+  cblas_sgemm(CblasRowMajor,CblasNoTrans,CblasTrans,(int)ni,(int)nj,(int)Z->size2,
+	      1.0f,Zi,(int)Z->tda,Zj,(int)Z->tda,0.0f,T,(int)nj);
+
+  for (i=0; i<ni; i++) {
+    float *t = &T[i*nj];
+    for (j=0; j<nj; j++) {
+      if (i0+i == j0+j) t[j] = 0;
+      else t[j] = SimilarityValue((double)t[j],type);
+    }
+  }
+}
+
+
+/*
+** per-thread buffers for strength and degree, 2n doubles per thread,
+** NULL if neither is requested
+*/
+double *DegreeBuffers(ECMMatrix *M,int nthreads)
+{
+  if (M->strength == NULL && M->degree == NULL) return NULL;
+  return (double *) VCalloc((size_t)nthreads*2*M->n,sizeof(double));
+}
+
+
+/*
+** add row and column sums of tile T to strength, and the number of
+** entries above M->dthreshold to degree, 'buf' is a per-thread buffer
+*/
+void TileDegree(ECMMatrix *M,const float *T,size_t i0,size_t ni,size_t j0,size_t nj,double *buf)
+{
+  size_t i,j,jmax;
+  double *strength = buf;
+  double *degree = &buf[M->n];
+  const float thr = M->dthreshold;
+
+  for (i=0; i<ni; i++) {
+    const float *t = &T[i*nj];
+    jmax = (i0 == j0) ? i : nj;   /* lower triangle, diagonal is zero */
+    double sum=0,cnt=0;
+    for (j=0; j<jmax; j++) {
+      sum += t[j];
+      strength[j0+j] += t[j];
+      if (t[j] > thr) {
+	cnt++;
+	degree[j0+j]++;
+      }
+    }
+    strength[i0+i] += sum;
+    degree[i0+i] += cnt;
+  }
+}
+
+
+/* sum up per-thread buffers */
+void DegreeReduce(ECMMatrix *M,double *buf,int nthreads)
+{
+  size_t i,n=M->n;
+  int k;
+
+  if (buf == NULL) return;
+#pragma omp parallel for private(k) schedule(static)
+  for (i=0; i<n; i++) {
+    double s=0,d=0;
+    for (k=0; k<nthreads; k++) {
+      s += buf[(size_t)k*2*n+i];
+      d += buf[(size_t)k*2*n+n+i];
+    }
+    if (M->strength) M->strength[i] = s;
+    if (M->degree) M->degree[i] = d;
+  }
+  VFree(buf);
+}
+
+
+/*
+** fill packed lower triangle M->A from cache-sized tiles,
+** each tile is one BLAS-3 call followed by the type transform.
+** Strength and degree are accumulated on the fly if requested.
+*/
+void SimilarityMatrix(ECMMatrix *M,const gsl_matrix_float *Z)
+{
+  size_t n = Z->size1;
+  size_t nblocks = (n+NBLOCK-1)/NBLOCK;
+  size_t bi,progress=0;
+  float *A = M->A;
+  int nthreads=1;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  double *dbuf = DegreeBuffers(M,nthreads);
+
+#pragma omp parallel shared(progress)
+  {
+    float *T = (float *) VCalloc(NBLOCK*NBLOCK,sizeof(float));
+    size_t bj,i,j;
+    int id=0;
+#ifdef _OPENMP
+    id = omp_get_thread_num();
+#endif
+
+    /* longest block rows first for better load balance */
+#pragma omp for schedule(dynamic)
+    for (bi=0; bi<nblocks; bi++) {
+      size_t bb = nblocks-1-bi;
+      size_t i0 = bb*NBLOCK;
+      size_t ni = (i0+NBLOCK > n) ? n-i0 : NBLOCK;
+#pragma omp atomic
+      progress++;
+      fprintf(stderr," %5ld of %ld\r",(long)progress,(long)nblocks);
+
+      for (bj=0; bj<=bb; bj++) {
+	size_t j0 = bj*NBLOCK;
+	size_t nj = (j0+NBLOCK > n) ? n-j0 : NBLOCK;
+	SimilarityTile(Z,i0,ni,j0,nj,M->type,T);
+	if (dbuf) TileDegree(M,T,i0,ni,j0,nj,&dbuf[(size_t)id*2*n]);
+
+	for (i=0; i<ni; i++) {
+	  const size_t ii = i0+i;
+	  const float *t = &T[i*nj];
+	  float *a = &A[ii*(ii+1)/2 + j0];
+	  size_t jmax = (bj == bb) ? i+1 : nj;
+	  for (j=0; j<jmax; j++) a[j] = t[j];
+	}
+      }
+    }
+    VFree(T);
+  }
+  fprintf(stderr,"\n");
+  DegreeReduce(M,dbuf,nthreads);
+}
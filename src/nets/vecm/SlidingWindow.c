@@ -0,0 +1,167 @@
+/*
+** ECM - dynamic ECM in sliding time windows.
+** Sums of products of all voxel pairs are kept in double precision
+** and updated incrementally as the window slides, so that each step
+** costs O(n*n*stride) instead of O(n*n*wlength).
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_cblas.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+
+/*
+** S += D Dw^T  and  s += row sums of Dw, S packed lower triangle.
+** D and Dw are n x k, row-major.
+*/
+void AddProducts(double *S,double *s,const double *D,const double *Dw,size_t n,size_t k)
+{
+  size_t nblocks = (n+NBLOCK-1)/NBLOCK;
+  size_t bi,i,l;
+
+#pragma omp parallel
+  {
+    double *T = (double *) VCalloc(NBLOCK*NBLOCK,sizeof(double));
+    size_t bj,ii,j;
+
+#pragma omp for schedule(dynamic)
+    for (bi=0; bi<nblocks; bi++) {
+      size_t bb = nblocks-1-bi;
+      size_t i0 = bb*NBLOCK;
+      size_t ni = (i0+NBLOCK > n) ? n-i0 : NBLOCK;
+
+      for (bj=0; bj<=bb; bj++) {
+	size_t j0 = bj*NBLOCK;
+	size_t nj = (j0+NBLOCK > n) ? n-j0 : NBLOCK;
+	cblas_dgemm(CblasRowMajor,CblasNoTrans,CblasTrans,(int)ni,(int)nj,(int)k,
+		    1.0,&D[i0*k],(int)k,&Dw[j0*k],(int)k,0.0,T,(int)nj);
+
+	for (ii=0; ii<ni; ii++) {
+	  const double *t = &T[ii*nj];
+	  double *a = &S[(i0+ii)*(i0+ii+1)/2 + j0];
+	  size_t jmax = (bj == bb) ? ii+1 : nj;
+	  for (j=0; j<jmax; j++) a[j] += t[j];
+	}
+      }
+    }
+    VFree(T);
+  }
+
+  for (i=0; i<n; i++) {
+    for (l=0; l<k; l++) s[i] += Dw[i*k+l];
+  }
+}
+
+
+/* correlations of the current window from the running sums */
+void WindowSimilarity(const double *S,const double *s,size_t n,size_t wlength,int type,float *A)
+{
+  size_t i;
+  const double L = (double)wlength;
+  double *inv = (double *) VCalloc(n,sizeof(double));
+
+  for (i=0; i<n; i++) {
+    double v = S[i*(i+1)/2+i] - s[i]*s[i]/L;
+    inv[i] = (v > 1.0e-8) ? 1.0/sqrt(v) : 0;
+  }
+
+#pragma omp parallel for schedule(dynamic,64)
+  for (i=0; i<n; i++) {
+    const double *srow = &S[i*(i+1)/2];
+    float *a = &A[i*(i+1)/2];
+    const double si = s[i]/L;
+    size_t j;
+    for (j=0; j<i; j++) {
+      double r = (srow[j] - si*s[j])*inv[i]*inv[j];
+      a[j] = SimilarityValue(r,type);
+    }
+    a[i] = 0;
+  }
+  VFree(inv);
+}
+
+
+/* copy columns [t0,t0+k) of Z into D, times w into Dw */
+void GetColumns(const gsl_matrix_float *Z,size_t t0,size_t k,double w,double *D,double *Dw,size_t ld)
+{
+  size_t i,l;
+  for (i=0; i<Z->size1; i++) {
+    const float *z = gsl_matrix_float_const_ptr(Z,i,t0);
+    for (l=0; l<k; l++) {
+      D[i*ld+l] = (double)z[l];
+      Dw[i*ld+l] = w*(double)z[l];
+    }
+  }
+}
+
+
+/*
+** ECM for windows of 'wlength' time points shifted by 'wstride'.
+** Returns nwin x n centralities, the eigenvector of each window
+** is the start vector of the next one.
+*/
+float *SlidingWindowECM(ECMMatrix *M,const gsl_matrix_float *Z,size_t wlength,size_t wstride,
+			int solver,float *ev,VBoolean warmstart,int *nwin)
+{
+  size_t n = M->n;
+  size_t nt = Z->size2;
+  size_t m = n*(n+1)/2;
+  size_t i,w,t0,k;
+
+  if (wlength < 3 || wlength > nt) VError(" illegal window length %ld, nt= %ld",(long)wlength,(long)nt);
+  if (wstride < 1) wstride = 1;
+  *nwin = (int)((nt-wlength)/wstride + 1);
+  fprintf(stderr," sliding windows: %d, length: %ld, stride: %ld\n",*nwin,(long)wlength,(long)wstride);
+
+  if (M->S == NULL) M->S = (double *) calloc(m,sizeof(double));
+  if (M->A == NULL) M->A = (float *) calloc(m,sizeof(float));
+  if (!M->S || !M->A) VError(" err allocating correlation matrix");
+  double *s = (double *) VCalloc(n,sizeof(double));
+  float *evs = (float *) VCalloc((size_t)(*nwin)*n,sizeof(float));
+
+  /* a full recompute is cheaper if the windows hardly overlap */
+  VBoolean incremental = (2*wstride < wlength);
+  k = incremental ? 2*wstride : wlength;
+  double *D  = (double *) VCalloc(n*wlength,sizeof(double));
+  double *Dw = (double *) VCalloc(n*wlength,sizeof(double));
+
+  for (w=0; w<(size_t)(*nwin); w++) {
+    t0 = w*wstride;
+    fprintf(stderr,"\n window %3ld:  %ld ... %ld\n",(long)w,(long)t0,(long)(t0+wlength-1));
+
+    if (w == 0 || !incremental) {
+      memset(M->S,0,m*sizeof(double));
+      memset(s,0,n*sizeof(double));
+      GetColumns(Z,t0,wlength,1.0,D,Dw,wlength);
+      AddProducts(M->S,s,D,Dw,n,wlength);
+    }
+    else {
+      /* add time points entering the window, remove those leaving it */
+      GetColumns(Z,t0+wlength-wstride,wstride,1.0,D,Dw,k);
+      GetColumns(Z,t0-wstride,wstride,-1.0,&D[wstride],&Dw[wstride],k);
+      AddProducts(M->S,s,D,Dw,n,k);
+    }
+
+    WindowSimilarity(M->S,s,n,wlength,M->type,M->A);
+    EigenvectorCentrality(M,ev,solver,(w > 0 || warmstart));
+    for (i=0; i<n; i++) evs[w*n+i] = ev[i];
+  }
+
+  VFree(D);
+  VFree(Dw);
+  VFree(s);
+  return evs;
+}
@@ -0,0 +1,314 @@
+/*
+** ECM - sparse similarity matrix in compressed sparse row (CSR) format.
+** Only edges above a threshold or the k strongest edges of each voxel
+** are kept. Both triangles are stored so that each row of the
+** product y = Ax can be computed independently.
+*/
+
+#include <viaio/Vlib.h>
+#include <viaio/mu.h>
+
+#include <gsl/gsl_matrix.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vecm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
+#define STRIPSIZE (1<<24)   /* max number of floats in one strip of rows */
+
+
+/* selected edges of a strip of consecutive rows */
+typedef struct StripStruct {
+  size_t nnz;
+  size_t cap;
+  unsigned int *col;
+  float *val;
+} Strip;
+
+
+void StripAppend(Strip *s,unsigned int j,float v)
+{
+  if (s->nnz >= s->cap) {
+    s->cap = (s->cap < 1024) ? 1024 : 2*s->cap;
+    s->col = (unsigned int *) VRealloc(s->col,s->cap*sizeof(unsigned int));
+    s->val = (float *) VRealloc(s->val,s->cap*sizeof(float));
+  }
+  s->col[s->nnz] = j;
+  s->val[s->nnz] = v;
+  s->nnz++;
+}
+
+
+/* min-heap of size k holding the k largest values of a row */
+void HeapSift(const float *t,unsigned int *heap,int k,int i)
+{
+  int c;
+  unsigned int tmp;
+
+  while ((c = 2*i+1) < k) {
+    if (c+1 < k && t[heap[c+1]] < t[heap[c]]) c++;
+    if (t[heap[i]] <= t[heap[c]]) break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+
+int CompareUInt(const void *a,const void *b)
+{
+  unsigned int u = *(const unsigned int *)a;
+  unsigned int v = *(const unsigned int *)b;
+  if (u < v) return -1;
+  if (u > v) return 1;
+  return 0;
+}
+
+
+/* column indices of the k largest entries of row t of length n, sorted */
+int TopK(const float *t,size_t n,size_t i,int k,unsigned int *heap)
+{
+  size_t j;
+  int l,m=0;
+
+  for (j=0; j<n; j++) {
+    if (j == i) continue;
+    if (m < k) {
+      heap[m++] = (unsigned int)j;
+      if (m == k) {
+	for (l=k/2-1; l>=0; l--) HeapSift(t,heap,k,l);
+      }
+    }
+    else if (t[j] > t[heap[0]]) {
+      heap[0] = (unsigned int)j;
+      HeapSift(t,heap,k,0);
+    }
+  }
+  qsort(heap,(size_t)m,sizeof(unsigned int),CompareUInt);
+  return m;
+}
+
+
+/*
+** make the top-k graph symmetric: keep (i,j) if j is among the k strongest
+** edges of i or i is among those of j
+*/
+void SymmetrizeCSR(ECMMatrix *M)
+{
+  size_t n = M->n;
+  size_t i,k,nnz = M->rowptr[n];
+  size_t *tptr = (size_t *) VCalloc(n+1,sizeof(size_t));
+  size_t *fill = (size_t *) VCalloc(n,sizeof(size_t));
+  size_t *uptr = (size_t *) VCalloc(n+1,sizeof(size_t));
+  unsigned int *tcol = (unsigned int *) VCalloc(nnz,sizeof(unsigned int));
+  float *tval = (float *) VCalloc(nnz,sizeof(float));
+
+  /* transpose, rows of the transpose come out sorted */
+  for (k=0; k<nnz; k++) tptr[M->col[k]+1]++;
+  for (i=0; i<n; i++) tptr[i+1] += tptr[i];
+  for (i=0; i<n; i++) {
+    for (k=M->rowptr[i]; k<M->rowptr[i+1]; k++) {
+      size_t j = M->col[k];
+      size_t l = tptr[j] + fill[j]++;
+      tcol[l] = (unsigned int)i;
+      tval[l] = M->val[k];
+    }
+  }
+  VFree(fill);
+
+  /* size of the union of each row and the same row of the transpose */
+#pragma omp parallel for schedule(dynamic,256)
+  for (i=0; i<n; i++) {
+    size_t a=M->rowptr[i],a1=M->rowptr[i+1];
+    size_t b=tptr[i],b1=tptr[i+1];
+    size_t m=0;
+    while (a < a1 || b < b1) {
+      if (b >= b1 || (a < a1 && M->col[a] < tcol[b])) a++;
+      else if (a >= a1 || tcol[b] < M->col[a]) b++;
+      else { a++; b++; }
+      m++;
+    }
+    uptr[i+1] = m;
+  }
+  for (i=0; i<n; i++) uptr[i+1] += uptr[i];
+
+  unsigned int *ucol = (unsigned int *) VCalloc(uptr[n],sizeof(unsigned int));
+  float *uval = (float *) VCalloc(uptr[n],sizeof(float));
+
+#pragma omp parallel for schedule(dynamic,256)
+  for (i=0; i<n; i++) {
+    size_t a=M->rowptr[i],a1=M->rowptr[i+1];
+    size_t b=tptr[i],b1=tptr[i+1];
+    size_t m=uptr[i];
+    while (a < a1 || b < b1) {
+      if (b >= b1 || (a < a1 && M->col[a] < tcol[b])) {
+	ucol[m] = M->col[a];
+	uval[m] = M->val[a];
+	a++;
+      }
+      else if (a >= a1 || tcol[b] < M->col[a]) {
+	ucol[m] = tcol[b];
+	uval[m] = tval[b];
+	b++;
+      }
+      else {
+	ucol[m] = M->col[a];
+	uval[m] = M->val[a];
+	a++; b++;
+      }
+      m++;
+    }
+  }
+
+  VFree(tptr);
+  VFree(tcol);
+  VFree(tval);
+  VFree(M->rowptr);
+  VFree(M->col);
+  VFree(M->val);
+  M->rowptr = uptr;
+  M->col = ucol;
+  M->val = uval;
+}
+
+
+/* strength and degree of the full row t, diagonal is zero */
+void RowDegree(ECMMatrix *M,const float *t,size_t n,size_t i)
+{
+  size_t j;
+  double sum=0,cnt=0;
+  const float thr = M->dthreshold;
+
+  for (j=0; j<n; j++) {
+    sum += t[j];
+    if (t[j] > thr && j != i) cnt++;
+  }
+  if (M->strength) M->strength[i] = sum;
+  if (M->degree) M->degree[i] = cnt;
+}
+
+
+/*
+** Build the sparse matrix from strips of consecutive rows.
+** Each strip is a single BLAS-3 product against all voxels.
+** Keeps entries whose correlation exceeds threshold, or the 'topk' largest entries
+** per row if topk > 0. For 'abs' and 'neg', the threshold refers to the absolute and
+** to the negated correlation. Strength and degree refer to the full matrix.
+*/
+void SparseMatrix(ECMMatrix *M,const gsl_matrix_float *Z,float threshold,int topk)
+{
+  size_t n = M->n;
+  size_t h = STRIPSIZE/n;
+  size_t i,s,nstrips,progress=0;
+
+  /* similarity of an edge whose correlation equals the threshold, 'add' shifts by one */
+  float cut = (M->type == 1) ? threshold+1.0f : threshold;
+
+  if (h > NBLOCK) h = NBLOCK;
+  if (h < 1) h = 1;
+  if (topk > 0 && (size_t)topk >= n) topk = (int)n-1;
+  nstrips = (n+h-1)/h;
+
+  Strip *strips = (Strip *) VCalloc(nstrips,sizeof(Strip));
+  M->rowptr = (size_t *) VCalloc(n+1,sizeof(size_t));
+
+#pragma omp parallel shared(progress)
+  {
+    float *T = (float *) VCalloc(h*n,sizeof(float));
+    unsigned int *heap = (unsigned int *) VCalloc((topk > 0 ? topk : 1),sizeof(unsigned int));
+    size_t ii,j,r;
+    int l,m;
+
+#pragma omp for schedule(dynamic)
+    for (s=0; s<nstrips; s++) {
+      size_t i0 = s*h;
+      size_t ni = (i0+h > n) ? n-i0 : h;
+      Strip *st = &strips[s];
+      SimilarityTile(Z,i0,ni,0,n,M->type,T);
+
+      for (r=0; r<ni; r++) {
+	const float *t = &T[r*n];
+	ii = i0+r;
+	size_t nnz0 = st->nnz;
+	if (M->strength || M->degree) RowDegree(M,t,n,ii);
+	if (topk > 0) {
+	  m = TopK(t,n,ii,topk,heap);
+	  for (l=0; l<m; l++) StripAppend(st,heap[l],t[heap[l]]);
+	}
+	else {
+	  for (j=0; j<n; j++) {
+	    if (j != ii && t[j] > cut) StripAppend(st,(unsigned int)j,t[j]);
+	  }
+	}
+	M->rowptr[ii+1] = st->nnz - nnz0;
+      }
+#pragma omp atomic
+      progress++;
+      if (progress % 16 == 0) fprintf(stderr," %5ld of %ld\r",(long)progress,(long)nstrips);
+    }
+    VFree(heap);
+    VFree(T);
+  }
+  fprintf(stderr,"\n");
+
+  /* concatenate strips */
+  for (i=0; i<n; i++) M->rowptr[i+1] += M->rowptr[i];
+  M->col = (unsigned int *) VCalloc(M->rowptr[n]+1,sizeof(unsigned int));
+  M->val = (float *) VCalloc(M->rowptr[n]+1,sizeof(float));
+
+#pragma omp parallel for schedule(dynamic)
+  for (s=0; s<nstrips; s++) {
+    size_t k = M->rowptr[s*h];
+    if (strips[s].nnz > 0) {
+      memcpy(&M->col[k],strips[s].col,strips[s].nnz*sizeof(unsigned int));
+      memcpy(&M->val[k],strips[s].val,strips[s].nnz*sizeof(float));
+    }
+    VFree(strips[s].col);
+    VFree(strips[s].val);
+  }
+  VFree(strips);
+
+  if (topk > 0) SymmetrizeCSR(M);
+
+  size_t nnz = M->rowptr[n];
+  fprintf(stderr," sparse matrix: %ld edges, density: %.3f %%\n",
+	  (long)(nnz/2),100.0*(double)nnz/((double)n*(double)(n-1)));
+  if (nnz < 1) VError(" no edges left, threshold too high");
+}
+
+
+/* y = Ax, rows are independent */
+void SparseMatVec(ECMMatrix *M,const float *x,float *y)
+{
+  size_t i,k,n = M->n;
+  const size_t *rowptr = M->rowptr;
+  const unsigned int *col = M->col;
+  const float *val = M->val;
+
+#pragma omp parallel for private(k) schedule(dynamic,512)
+  for (i=0; i<n; i++) {
+    float sum=0;
+#pragma omp simd reduction(+:sum)
+    for (k=rowptr[i]; k<rowptr[i+1]; k++) sum += val[k]*x[col[k]];
+    y[i] = sum;
+  }
+}
+
+
+void SparseFree(ECMMatrix *M)
+{
+  VFree(M->rowptr);
+  VFree(M->col);
+  VFree(M->val);
+  M->rowptr = NULL;
+  M->col = NULL;
+  M->val = NULL;
+}
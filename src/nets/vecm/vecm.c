@@ -16,11 +16,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
 #include <time.h>
 
+#include "vecm.h"
+
 #define NSLICES 10000
 
 #define SQR(x) ((x) * (x))
@@ -32,91 +35,6 @@
 #include <omp.h>
 #endif /*_OPENMP*/
 
-/* re-implementation of cblas_sspmv,  cblas_sspmv causes problems */
-void my_sspmv(float *A,float *x,float *y,int n)
-{
-  int i,j;
-  size_t k,kk;
-  float tmp1=0,tmp2=0;
-
-  kk = k = 0;
-  for (j=0; j<n; j++) {
-    y[j] = 0;
-    tmp1 = x[j];
-    tmp2 = 0;
-    k = kk;
-    for (i=0; i<j; i++) {
-      y[i] += tmp1 * A[k];
-      tmp2 += A[k] * x[i];
-      k++;
-    }
-    y[j] += tmp1*A[kk+j] + tmp2;
-    kk += (j+1);
-  }
-}
-
-
-double Correlation(const float * arr1,const float * arr2,int n)
-{
-  int i;
-  double sx,sy,sxx,syy,sxy,rx;
-  double tiny=1.0e-4;
-
-  sxx = syy = sxy = sx = sy = 0;
-  for (i=0; i<n; i++) {
-    const double u = (double)arr1[i];
-    const double v = (double)arr2[i];
-    sx  += u;
-    sy  += v;
-    sxx += u*u;
-    syy += v*v;
-    sxy += u*v;
-  }
-  const double nx= n;
-  const double u = nx*sxx - sx*sx;
-  const double v = nx*syy - sy*sy;
-  rx = 0;
-  if (u*v > tiny)
-    rx = (nx*sxy - sx*sy)/sqrt(u*v);
-
-  return rx;
-}
-
-void EigenvectorCentrality(float *A,float *ev,int n)
-{
-  int i,iter,maxiter;
-  float sum,d,nx;
-  static float *y=NULL;
-
-  fprintf(stderr," power iteration...\n");
-  if (y==NULL) y = (float *) VCalloc(n,sizeof(float));
-  nx = sqrt((double)n);
-  for (i=0; i<n; i++) ev[i] = y[i] = 1.0/nx;
-
-  maxiter=50;
-  for (iter=0; iter < maxiter; iter++) {
-
-    /* y = Ax,  A symmetric and lower-triangular */
-    /* cblas_sspmv(CblasRowMajor,CblasLower,(int)n,1.0f,A,ev,1,1.0f,y,1); */
-    my_sspmv(A,ev,y,n);
-      
-    sum = 0;
-    for (i=0; i<n; i++) sum += y[i]*y[i];
-    sum = sqrt(sum);
-
-    d = 0;
-    for (i=0; i<n; i++) {
-      d += SQR(ev[i] - y[i]/sum);
-      ev[i] = y[i]/sum;
-    }
-    fprintf(stderr," %5d  %f\n",(int)iter,d);
-    if (d < 1.0e-6) break;
-  }
-  for (i=0; i<n; i++) ev[i] *= 100.0;
-  fprintf(stderr," ecm done..\n");
-}
-
-
 VImage WriteOutput(VImage src,VImage map,int nslices,int nrows, int ncols, float *ev, int n)
 {
   VImage dest=NULL;
@@ -138,27 +56,57 @@ VImage WriteOutput(VImage src,VImage map,int nslices,int nrows, int ncols, float
 }
 
 
-
-VAttrList VECM(VAttrList list,VImage mask,VShort first,VShort length,VShort type)
+/* dynamic ECM, one image per slice with one band per window as in the functional data */
+VAttrList WriteWindows(VImage *src,VImage map,ECMAtlas *atlas,int nslices,float *evs,int nwin,size_t n)
 {
   VAttrList out_list=NULL;
+  VImage *dest=NULL;
+  int b,r,c,w;
+  size_t i;
+
+  dest = (VImage *) VCalloc(nslices,sizeof(VImage));
+  for (b=0; b<nslices; b++) {
+    dest[b] = VCreateImage(nwin,VImageNRows(src[b]),VImageNColumns(src[b]),VFloatRepn);
+    VFillImage(dest[b],VAllBands,0);
+    VCopyImageAttrs (src[b], dest[b]);
+    VSetAttr(VImageAttrList(dest[b]),"modality",NULL,VStringRepn,"conimg");
+    VSetAttr(VImageAttrList(dest[b]),"name",NULL,VStringRepn,"ECM");
+  }
+
+  for (i=0; i<VImageNColumns(map); i++) {
+    b = VPixel(map,0,0,i,VFloat);
+    r = VPixel(map,0,1,i,VFloat);
+    c = VPixel(map,0,2,i,VFloat);
+    if (atlas == NULL) {
+      for (w=0; w<nwin; w++) VPixel(dest[b],w,r,c,VFloat) = evs[(size_t)w*n+i];
+    }
+    else if (atlas->parcel[i] >= 0) {
+      for (w=0; w<nwin; w++) VPixel(dest[b],w,r,c,VFloat) = evs[(size_t)w*atlas->nparcels+atlas->parcel[i]];
+    }
+  }
+
+  out_list = VCreateAttrList();
+  for (b=0; b<nslices; b++) VAppendAttr(out_list,"image",NULL,VImageRepn,dest[b]);
+  VFree(dest);
+  return out_list;
+}
+
+
+
+/*
+** voxel addresses of the mask, the image dimensions are kept in row 3
+*/
+VImage VoxelMap(VAttrList list,VImage mask)
+{
   VAttrListPosn posn;
   VImage src[NSLICES],map=NULL;
-  VImage dest=NULL;
-  int b,r,c,ntimesteps,nrows,ncols,nslices,nt,last;
-  size_t i,j,n,m;
-  gsl_matrix_float *mat=NULL;
-  float *A=NULL,*ev=NULL;
-  float tiny=1.0e-6;
+  int b,r,c,nrows,ncols,nslices;
+  size_t i,n;
 
-  /*
-  ** get image dimensions
-  */
-  i = ntimesteps = nrows = ncols = 0;
+  i = nrows = ncols = 0;
   for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
     if (VGetAttrRepn (& posn) != VImageRepn) continue;
     VGetAttrValue (& posn, NULL,VImageRepn, & src[i]);
-    if (VImageNBands(src[i]) > ntimesteps) ntimesteps = VImageNBands(src[i]);
     if (VImageNRows(src[i])  > nrows)  nrows = VImageNRows(src[i]);
     if (VImageNColumns(src[i]) > ncols) ncols = VImageNColumns(src[i]);
     i++;
@@ -174,18 +122,6 @@ VAttrList VECM(VAttrList list,VImage mask,VShort first,VShort length,VShort type
     VError(" number of columns inconsistent: %d, mask: %d",ncols,VImageNColumns(mask));
 
 
-  /* get time steps to include */
-  if (length < 1) length = ntimesteps-1;
-  last = first + length;
-  if (last >= ntimesteps) last = ntimesteps-1;
-  if (first < 0) first = 0;
-
-  nt = last - first + 1;
-  if (nt < 2) VError(" not enough timesteps, nt= %d",nt);
-  fprintf(stderr,"# ntimesteps: %d, first= %d, last= %d, nt= %d\n",
-	  (int)ntimesteps,(int)first,(int)last,(int)nt);
-
-
   /* count number of voxels */
   n = 0;
   for (b=0; b<nslices; b++) {
@@ -200,10 +136,6 @@ VAttrList VECM(VAttrList list,VImage mask,VShort first,VShort length,VShort type
   fprintf(stderr," nvoxels: %ld\n",(long)n);
 
 
-
-  /*
-  ** voxel addresses
-  */
   map = VCreateImage(1,5,n,VFloatRepn);
   if (map == NULL) VError(" error allocating addr map");
   VFillImage(map,VAllBands,0);
@@ -225,17 +157,122 @@ VAttrList VECM(VAttrList list,VImage mask,VShort first,VShort length,VShort type
       }
     }
   }
+  return map;
+}
+
+
+
+/* start vector from a previous ECM image */
+void ECMStartVector(VImage init,VImage map,ECMAtlas *atlas,float *ev)
+{
+  int b,r,c;
+  size_t i,n=VImageNColumns(map);
+  float *x = (atlas) ? (float *) VCalloc(n,sizeof(float)) : ev;
+
+  for (i=0; i<n; i++) {
+    b = VPixel(map,0,0,i,VFloat);
+    r = VPixel(map,0,1,i,VFloat);
+    c = VPixel(map,0,2,i,VFloat);
+    x[i] = VGetPixel(init,b,r,c);
+  }
+  if (atlas) {
+    VoxelToParcel(atlas,x,ev,n);
+    VFree(x);
+  }
+}
+
+
+/* centrality map, parcel values are projected to voxels or written as a table */
+VImage ECMImage(VImage src,VImage map,ECMAtlas *atlas,float *x,VString name)
+{
+  VImage dest=NULL;
+  size_t n = VImageNColumns(map);
+  int nslices = VPixel(map,0,3,0,VFloat);
+  int nrows   = VPixel(map,0,3,1,VFloat);
+  int ncols   = VPixel(map,0,3,2,VFloat);
+
+  if (atlas == NULL) {
+    dest = WriteOutput(src,map,nslices,nrows,ncols,x,n);
+  }
+  else if (atlas->project) {
+    float *y = (float *) VCalloc(n,sizeof(float));
+    ParcelToVoxel(atlas,x,y,n);
+    dest = WriteOutput(src,map,nslices,nrows,ncols,y,n);
+    VFree(y);
+  }
+  else {
+    dest = ParcelTable(atlas,x);
+  }
+  VSetAttr(VImageAttrList(dest),"name",NULL,VStringRepn,name);
+  return dest;
+}
+
+
+/*
+** ECM of one data set. The voxel map and the buffers held by M
+** are re-used across data sets of the same geometry.
+*/
+VAttrList VECM(VAttrList list,VImage map,ECMAtlas *atlas,ECMMatrix *M,VShort first,VShort length,
+	       VShort solver,VImage init,VString scratch,VShort tilemem,VFloat threshold,VShort topk,
+	       VShort wlength,VShort wstride)
+{
+  VAttrList out_list=NULL;
+  VAttrListPosn posn;
+  VImage src[NSLICES];
+  VImage dest=NULL;
+  int b,r,c,ntimesteps,nrows,ncols,nslices,nt,last;
+  size_t i,j,m;
+  size_t nvox = VImageNColumns(map);
+  size_t n = M->n;  /* number of voxels or parcels */
+  gsl_matrix_float *mat=NULL;
+  float *ev=NULL;
+
+  /*
+  ** get image dimensions
+  */
+  i = ntimesteps = 0;
+  for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
+    if (VGetAttrRepn (& posn) != VImageRepn) continue;
+    VGetAttrValue (& posn, NULL,VImageRepn, & src[i]);
+    if (VImageNBands(src[i]) > ntimesteps) ntimesteps = VImageNBands(src[i]);
+    i++;
+    if (i >= NSLICES) VError(" too many slices");
+  }
+  nslices = VPixel(map,0,3,0,VFloat);
+  nrows   = VPixel(map,0,3,1,VFloat);
+  ncols   = VPixel(map,0,3,2,VFloat);
+  if (i != nslices) VError(" number of slices inconsistent: %d, mask: %d",(int)i,nslices);
+
+
+  /* get time steps to include */
+  if (length < 1) length = ntimesteps-1;
+  last = first + length;
+  if (last >= ntimesteps) last = ntimesteps-1;
+  if (first < 0) first = 0;
+
+  nt = last - first + 1;
+  if (nt < 2) VError(" not enough timesteps, nt= %d",nt);
+  fprintf(stderr,"# ntimesteps: %d, first= %d, last= %d, nt= %d\n",
+	  (int)ntimesteps,(int)first,(int)last,(int)nt);
 
 
   /*
   ** avoid casting to float, copy data to matrix
   */
-  mat = gsl_matrix_float_calloc(n,nt);
-  for (i=0; i<n; i++) {
+  if (M->Z != NULL && M->Z->size2 != (size_t)nt) {
+    gsl_matrix_float_free(M->Z);
+    M->Z = NULL;
+  }
+  if (M->Z == NULL) M->Z = gsl_matrix_float_calloc(n,nt);
+  mat = (atlas) ? gsl_matrix_float_calloc(nvox,nt) : M->Z;
+
+  for (i=0; i<nvox; i++) {
 
     b = VPixel(map,0,0,i,VFloat);
     r = VPixel(map,0,1,i,VFloat);
     c = VPixel(map,0,2,i,VFloat);
+    if (VImageNRows(src[b]) != nrows || VImageNColumns(src[b]) != ncols)
+      VError(" image dimensions differ from mask in slice %d",b);
 
     float *ptr = gsl_matrix_float_ptr(mat,i,0);
     int k;
@@ -249,73 +286,158 @@ VAttrList VECM(VAttrList list,VImage mask,VShort first,VShort length,VShort type
   }
 
 
+  /* average within parcels */
+  if (atlas) {
+    ParcelTimeSeries(atlas,mat,M->Z);
+    gsl_matrix_float_free(mat);
+    mat = M->Z;
+  }
+
+
   /*
-  ** compute similarity matrix
+  ** normalize time series, dot products are now correlations
   */
-  m = (n*(n+1))/2;
-  fprintf(stderr," matrix computation, n= %ld...\n",(long)n);
-  A = (float *) calloc(m,sizeof(float));
-  if (!A) VError(" err allocating correlation matrix");
-  memset(A,0,m*sizeof(float));
-  size_t progress=0;
+  VNormalizeRows(mat);
 
 
-#pragma omp parallel for shared(progress) private(j) schedule(guided) firstprivate(mat,A)
-  for (i=0; i<n; i++) {
-    if (i%100 == 0) fprintf(stderr," %d00\r",(int)(++progress));
+  /*
+  ** dynamic ECM in sliding windows
+  */
+  if (wlength > 0) {
+    int nwin=0;
+    ev = (float *) VCalloc(n,sizeof(float));
+    if (init) ECMStartVector(init,map,atlas,ev);
+    float *evs = SlidingWindowECM(M,mat,(size_t)wlength,(size_t)wstride,(int)solver,ev,(init != NULL),&nwin);
+    out_list = WriteWindows(src,map,atlas,nslices,evs,nwin,n);
+    VFree(evs);
+    VFree(ev);
+    return out_list;
+  }
 
-    const float *arr1 = gsl_matrix_float_const_ptr(mat,i,0);
-    for (j=0; j<=i; j++) {
-      if (i == j) continue;
-      const float *arr2 = gsl_matrix_float_const_ptr(mat,j,0);
-      const double v = Correlation(arr1,arr2,nt);
-      double u = 0;
 
-      /* make positive */
-      switch (type) {
+  /*
+  ** matrix-free: keep normalized time series only
+  */
+  if (M->mode == ECM_MATRIXFREE) {
+    fprintf(stderr," matrix-free, n= %ld...\n",(long)n);
+    MatrixFreeDegree(M);
+  }
 
-      case 0:
-	if (v > tiny) u = v;
-	break;
 
-      case 1:
-	u = v + 1.0f;
-	break;
+  /*
+  ** compute similarity matrix
+  */
+  if (M->mode == ECM_PACKED) {
+    m = (n*(n+1))/2;
+    fprintf(stderr," matrix computation, n= %ld...\n",(long)n);
+    if (M->A == NULL) M->A = (float *) calloc(m,sizeof(float));
+    if (!M->A) VError(" err allocating correlation matrix, try '-mode outofcore'");
+    SimilarityMatrix(M,mat);
+    fprintf(stderr," matrix done.\n");
+  }
 
-      case 2:
-	u = ABS(v);
-	break;
 
-      case 3:
-	if (v < -tiny) u = -v;
-	break;
+  /*
+  ** out-of-core: similarity matrix in a memory-mapped scratch file
+  */
+  if (M->mode == ECM_OUTOFCORE) {
+    fprintf(stderr," matrix computation, n= %ld...\n",(long)n);
+    OutOfCoreMatrix(M,mat,scratch,(size_t)tilemem*1024*1024);
+    fprintf(stderr," matrix done.\n");
+  }
 
-      default:
-	VError(" illegal type");
-      }
-      if (u < tiny) u = tiny;
 
-      const size_t k=j+i*(i+1)/2;
-      if (k >= m) VError(" illegal addr k= %d, m= %d",k,m);
-      A[k] = u;
-    }
+  /*
+  ** sparse: keep strong edges only
+  */
+  if (M->mode == ECM_SPARSE) {
+    fprintf(stderr," sparse matrix computation, n= %ld...\n",(long)n);
+    if (M->rowptr != NULL) SparseFree(M);
+    SparseMatrix(M,mat,threshold,(int)topk);
+    fprintf(stderr," matrix done.\n");
   }
-  fprintf(stderr," matrix done.\n");
-  gsl_matrix_float_free(mat);
 
   /*
   ** eigenvector centrality
   */
   ev = (float *) VCalloc(n,sizeof(float));
-  EigenvectorCentrality(A,ev,n);
-  dest = WriteOutput(src[0],map,nslices,nrows,ncols,ev,n);
-  VSetAttr(VImageAttrList(dest),"name",NULL,VStringRepn,"ECM");
+  if (init) ECMStartVector(init,map,atlas,ev);
+  EigenvectorCentrality(M,ev,(int)solver,(init != NULL));
+  dest = ECMImage(src[0],map,atlas,ev,"ECM");
 
   out_list = VCreateAttrList();
   VAppendAttr(out_list,"image",NULL,VImageRepn,dest);
+
+
+  /*
+  ** strength and degree, computed while filling the matrix
+  */
+  if (M->strength) {
+    for (i=0; i<n; i++) ev[i] = (float)M->strength[i];
+    dest = ECMImage(src[0],map,atlas,ev,"strength");
+    VAppendAttr(out_list,"image",NULL,VImageRepn,dest);
+  }
+  if (M->degree) {
+    for (i=0; i<n; i++) ev[i] = (float)M->degree[i];
+    dest = ECMImage(src[0],map,atlas,ev,"degree");
+    VAppendAttr(out_list,"image",NULL,VImageRepn,dest);
+  }
+  VFree(ev);
   return out_list;
 }
 
+
+/*
+** file names given on the command line, a single name ending in '.txt'
+** is a list file holding one file name per line
+*/
+VString *GetFileNames(VArgVector *files,int *nfiles)
+{
+  VString *names=NULL;
+  VStringConst name;
+  char buf[1024];
+  int i,n=files->number;
+  FILE *fp=NULL;
+
+  name = ((VStringConst *) files->vector)[0];
+  if (n == 1 && strlen(name) > 4 && strcmp(&name[strlen(name)-4],".txt") == 0) {
+    fp = fopen(name,"r");
+    if (fp == NULL) VError(" error opening list file %s",name);
+    n = 0;
+    while (fscanf(fp,"%1023s",buf) == 1) n++;
+    rewind(fp);
+    names = (VString *) VCalloc(n,sizeof(VString));
+    for (i=0; i<n; i++) {
+      if (fscanf(fp,"%1023s",buf) != 1) VError(" error reading list file %s",name);
+      names[i] = (VString) VCalloc(strlen(buf)+1,sizeof(char));
+      strcpy(names[i],buf);
+    }
+    fclose(fp);
+  }
+  else {
+    names = (VString *) VCalloc(n,sizeof(VString));
+    for (i=0; i<n; i++) names[i] = VNewString(((VStringConst *) files->vector)[i]);
+  }
+  if (n < 1) VError(" no file names found");
+  *nfiles = n;
+  return names;
+}
+
+
+VDictEntry ModeDict[] = {
+  { "packed", 0, 0,0,0,0 },
+  { "matrixfree", 1, 0,0,0,0 },
+  { "outofcore", 2, 0,0,0,0 },
+  { "sparse", 3, 0,0,0,0 },
+  { NULL, 0,0,0,0,0 }
+};
+
+VDictEntry SolverDict[] = {
+  { "power", 0, 0,0,0,0 },
+  { "lanczos", 1, 0,0,0,0 },
+  { NULL, 0,0,0,0,0 }
+};
+
 VDictEntry TYPDict[] = {
   { "pos", 0, 0,0,0,0 },
   { "add", 1, 0,0,0,0 },
@@ -327,25 +449,101 @@ VDictEntry TYPDict[] = {
 int main (int argc,char *argv[])
 {
 	
+  static VArgVector in_files;
+  static VArgVector out_files;
+  static VBoolean in_found, out_found;
   static VString  mask_filename = "";
+  static VString  init_filename = "";
+  static VString  atlas_filename = "";
+  static VBoolean project = TRUE;
+  static VString  scratch = "";
+  static VShort   tilemem = 1024;
+  static VFloat   threshold = 0;
+  static VShort   topk = 0;
   static VShort   first  = 0;
   static VShort   length = 0;
   static VShort   type   = 1;
+  static VShort   mode   = 0;
+  static VShort   solver = 0;
+  static VBoolean strength = FALSE;
+  static VFloat   degree = 0;
+  static VShort   wlength = 0;
+  static VShort   wstride = 1;
   static VShort   nproc  = 10;
   static VOptionDescRec  options[] = {
+    {"in",VStringRepn,0,(VPointer) &in_files,&in_found,NULL,"Input files, or a list file (*.txt)"},
+    {"out",VStringRepn,0,(VPointer) &out_files,&out_found,NULL,"Output files, or a list file (*.txt)"},
     {"mask",VStringRepn,1,(VPointer) &mask_filename,VRequiredOpt,NULL,"mask"},
+    {"atlas",VStringRepn,1,(VPointer) &atlas_filename,VOptionalOpt,NULL,"label image, ECM is computed on the mean time series of each label"},
+    {"project",VBooleanRepn,1,(VPointer) &project,VOptionalOpt,NULL,"project parcel values to voxels, otherwise write a table of labels and values"},
     {"first",VShortRepn,1,(VPointer) &first,VOptionalOpt,NULL,"First timestep to use"},
     {"length",VShortRepn,1,(VPointer) &length,VOptionalOpt,NULL,"Length of time series to use, '0' to use full length"},
     {"type",VShortRepn,1,(VPointer) &type,VOptionalOpt,TYPDict,"type of scaling to make correlations positive"},
+    {"mode",VShortRepn,1,(VPointer) &mode,VOptionalOpt,ModeDict,"storage of similarity matrix, 'matrixfree' needs O(n*nt) memory only"},
+    {"scratch",VStringRepn,1,(VPointer) &scratch,VOptionalOpt,NULL,"directory of scratch file for 'outofcore', default: $TMPDIR or /tmp"},
+    {"tilemem",VShortRepn,1,(VPointer) &tilemem,VOptionalOpt,NULL,"memory in MB for matrix tiles in 'outofcore' mode"},
+    {"threshold",VFloatRepn,1,(VPointer) &threshold,VOptionalOpt,NULL,"keep edges whose correlation exceeds threshold in 'sparse' mode"},
+    {"topk",VShortRepn,1,(VPointer) &topk,VOptionalOpt,NULL,"keep the k strongest edges of each voxel in 'sparse' mode"},
+    {"strength",VBooleanRepn,1,(VPointer) &strength,VOptionalOpt,NULL,"additionally compute strength centrality"},
+    {"degree",VFloatRepn,1,(VPointer) &degree,VOptionalOpt,NULL,"additionally compute degree centrality using this threshold, '0' for none"},
+    {"wlength",VShortRepn,1,(VPointer) &wlength,VOptionalOpt,NULL,"length of sliding windows for dynamic ECM, '0' for static ECM"},
+    {"wstride",VShortRepn,1,(VPointer) &wstride,VOptionalOpt,NULL,"shift of sliding windows in timesteps"},
+    {"solver",VShortRepn,1,(VPointer) &solver,VOptionalOpt,SolverDict,"eigensolver"},
+    {"init",VStringRepn,1,(VPointer) &init_filename,VOptionalOpt,NULL,"ECM image used as start vector (warm start)"},
     {"j",VShortRepn,1,(VPointer) &nproc,VOptionalOpt,NULL,"number of processors to use, '0' to use all"}
   };
-  FILE *out_file=NULL;
-  VString in_file=NULL;
+  VString *in_names=NULL,*out_names=NULL;
+  int s,nsubjects=0,nout=0;
   char *prg_name=GetLipsiaName("vecm");
   fprintf(stderr, "%s\n", prg_name);
 
-  VParseFilterCmdX (VNumber (options),options,argc,argv,&in_file,&out_file);
+  if (! VParseCommand (VNumber (options), options, & argc, argv)) {
+    VReportUsage (argv[0], VNumber (options), options, "[infile] [outfile]");
+    exit (EXIT_FAILURE);
+  }
+
+  /* without -in and -out, one input and one output file as in VParseFilterCmdX */
+  if (! in_found && ! out_found) {
+    static VString in_file, out_file;
+    static VBoolean in_file_found, out_file_found;
+    static VOptionDescRec io_opts[] = {
+      {"in",VStringRepn,1,(VPointer) &in_file,&in_file_found,NULL,"Input file"},
+      {"out",VStringRepn,1,(VPointer) &out_file,&out_file_found,NULL,"Output file"}
+    };
+    if (! VIdentifyFiles (VNumber (io_opts), io_opts, "in", & argc, argv, 0) ||
+	! VIdentifyFiles (VNumber (io_opts), io_opts, "out", & argc, argv, 1)) {
+      VReportUsage (argv[0], VNumber (options), options, "[infile] [outfile]");
+      exit (EXIT_FAILURE);
+    }
+    in_files.number = out_files.number = 1;
+    in_files.vector = (VPointer) &in_file;
+    out_files.vector = (VPointer) &out_file;
+  }
+  else if (! in_found || ! out_found) VError(" '-in' and '-out' must be given together");
+  if (argc > 1) {
+    VReportBadArgs (argc, argv);
+    exit (EXIT_FAILURE);
+  }
   if (type > 3) VError(" illegal type");
+  if (mode > 3) VError(" illegal mode");
+  if (mode == ECM_SPARSE && topk < 1 && threshold <= 0)
+    VError(" sparse mode needs '-threshold' or '-topk'");
+  if (topk > 0 && threshold > 0) VError(" '-threshold' and '-topk' cannot be combined");
+  if (threshold >= 1) VError(" threshold must be less than 1");
+  if (tilemem < 1) VError(" tilemem must be positive");
+  if (wlength > 0 && mode != ECM_PACKED) VError(" sliding windows need '-mode packed'");
+  if (wlength > 0 && (strength || degree > 0)) VError(" strength and degree are not available for sliding windows");
+  if (wlength > 0 && strlen(atlas_filename) > 1 && !project)
+    VError(" sliding windows need '-project true'");
+  if (strlen(scratch) < 1) {
+    scratch = getenv("TMPDIR");
+    if (scratch == NULL || strlen(scratch) < 1) scratch = "/tmp";
+  }
+
+  in_names  = GetFileNames(&in_files,&nsubjects);
+  out_names = GetFileNames(&out_files,&nout);
+  if (nout != nsubjects)
+    VError(" number of input files (%d) and output files (%d) differ",nsubjects,nout);
 
 
   /* read mask */
@@ -354,10 +552,56 @@ int main (int argc,char *argv[])
   if (mask == NULL) VError(" no ROI mask found");
 
 
-  /* read functional data */
-  VAttrList list = VReadAttrList(in_file,0L,TRUE,FALSE);
-  if (list == NULL) VError(" error reading input file %s",in_file);
-  VAttrList geolist = VGetGeoInfo(list);
+  /* read start vector */
+  VImage init = NULL;
+  if (strlen(init_filename) > 1) {
+    VAttrList listi = VReadAttrList(init_filename,0L,TRUE,FALSE);
+    init = VReadImage(listi);
+    if (init == NULL) VError(" no start vector found in %s",init_filename);
+    if (VImageNBands(init) != VImageNBands(mask) || VImageNRows(init) != VImageNRows(mask)
+	|| VImageNColumns(init) != VImageNColumns(mask))
+      VError(" start vector and mask have different dimensions");
+  }
+
+
+  /* read label atlas */
+  VImage atlas_image = NULL;
+  if (strlen(atlas_filename) > 1) {
+    VAttrList lista = VReadAttrList(atlas_filename,0L,TRUE,FALSE);
+    atlas_image = VReadImage(lista);
+    if (atlas_image == NULL) VError(" no atlas found in %s",atlas_filename);
+    if (VImageNBands(atlas_image) != VImageNBands(mask) || VImageNRows(atlas_image) != VImageNRows(mask)
+	|| VImageNColumns(atlas_image) != VImageNColumns(mask))
+      VError(" atlas and mask have different dimensions");
+  }
+
+
+  /* read functional data of the first subject */
+  VAttrList *list = (VAttrList *) VCalloc(nsubjects,sizeof(VAttrList));
+  VAttrList *out_list = (VAttrList *) VCalloc(nsubjects,sizeof(VAttrList));
+  list[0] = VReadAttrList(in_names[0],0L,TRUE,FALSE);
+  if (list[0] == NULL) VError(" error reading input file %s",in_names[0]);
+
+
+  /* voxel addresses, the same for all subjects */
+  VImage map = VoxelMap(list[0],mask);
+  ECMAtlas *atlas = (atlas_image) ? ParcelMap(atlas_image,map,project) : NULL;
+  ECMMatrix M;
+  M.mode = mode;
+  M.type = type;
+  M.n = (atlas) ? atlas->nparcels : VImageNColumns(map);
+  M.A = NULL;
+  M.Z = NULL;
+  M.fd = -1;
+  M.nwin = 0;
+  M.wrow = NULL;
+  M.rowptr = NULL;
+  M.col = NULL;
+  M.val = NULL;
+  M.S = NULL;
+  M.strength = (strength) ? (double *) VCalloc(M.n,sizeof(double)) : NULL;
+  M.degree = (degree > 0) ? (double *) VCalloc(M.n,sizeof(double)) : NULL;
+  M.dthreshold = degree;
 
 
 
@@ -365,27 +609,66 @@ int main (int argc,char *argv[])
 #ifdef _OPENMP
   int num_procs=omp_get_num_procs();
   if (nproc > 0 && nproc < num_procs) num_procs = nproc;
-  printf("using %d cores\n",(int)num_procs);
+  fprintf(stderr," using %d cores\n",(int)num_procs);
   omp_set_num_threads(num_procs);
+  omp_set_max_active_levels(2);
 #endif /* _OPENMP */
 
 
-  /* main process */
-  VAttrList out_list = VECM(list,mask,first,length,type);
-
+  /*
+  ** main process. While subject s is processed, the output of subject s-1
+  ** is written and subject s+1 is read in the background.
+  ** All file I/O is done by the background thread.
+  */
+  for (s=0; s<=nsubjects; s++) {
+    if (s < nsubjects) fprintf(stderr,"\n subject %3d:  %s\n",s,in_names[s]);
+
+#pragma omp parallel sections num_threads(2)
+    {
+#pragma omp section
+      {
+	if (s > 0) {
+	  VAttrList geolist = VGetGeoInfo(list[s-1]);
+
+	  /* update geoinfo, 4D to 3D, or number of windows */
+	  if (geolist != NULL && (atlas == NULL || atlas->project)) {
+	    double *D = VGetGeoDim(geolist,NULL);
+	    VImage dest = VReadImage(out_list[s-1]);
+	    D[0] = (VImageNBands(dest) > 1 && wlength > 0) ? 4 : 3;
+	    D[4] = (wlength > 0) ? VImageNBands(dest) : 1;  /* one timestep per window */
+	    VSetGeoDim(geolist,D);
+	    VSetGeoInfo(geolist,out_list[s-1]);
+	  }
+
+	  /* write output */
+	  FILE *out_file = VOpenOutputFile (out_names[s-1], TRUE);
+	  VHistory(VNumber(options),options,prg_name,&list[s-1],&out_list[s-1]);
+	  if (! VWriteFile (out_file, out_list[s-1])) exit (1);
+	  fclose(out_file);
+
+	  /* geoinfo and history are shared with the output list */
+	  VDestroyAttrList(out_list[s-1]);
+	  VExtractAttr(list[s-1],"geoinfo",NULL,VAttrListRepn,NULL,FALSE);
+	  VExtractAttr(list[s-1],"imageinfo",NULL,VAttrListRepn,NULL,FALSE);
+	  VExtractAttr(list[s-1],"history",NULL,VAttrListRepn,NULL,FALSE);
+	  VDestroyAttrList(list[s-1]);
+	  list[s-1] = out_list[s-1] = NULL;
+	}
+	if (s+1 < nsubjects) {
+	  list[s+1] = VReadAttrList(in_names[s+1],0L,TRUE,FALSE);
+	  if (list[s+1] == NULL) VError(" error reading input file %s",in_names[s+1]);
+	}
+      }
 
-  /* update geoinfo, 4D to 3D */
-  if (geolist != NULL) {
-    double *D = VGetGeoDim(geolist,NULL);
-    D[0] = 3;  /* 3D */
-    D[4] = 1;  /* just one timestep */
-    VSetGeoDim(geolist,D);
-    VSetGeoInfo(geolist,out_list);
+#pragma omp section
+      {
+	if (s < nsubjects)
+	  out_list[s] = VECM(list[s],map,atlas,&M,first,length,solver,init,scratch,tilemem,threshold,topk,wlength,wstride);
+      }
+    }
   }
 
-  /* write output */
-  VHistory(VNumber(options),options,prg_name,&list,&out_list);
-  if (! VWriteFile (out_file, out_list)) exit (1);
+  if (M.mode == ECM_OUTOFCORE) OutOfCoreFree(&M);
   fprintf (stderr, "%s: done.\n", argv[0]);
   return 0;
 }
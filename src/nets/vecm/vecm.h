@@ -0,0 +1,81 @@
+/*
+** ECM - data structures shared by the modules of vecm
+*/
+
+/* storage modes of the similarity matrix */
+#define ECM_PACKED     0   /* packed lower triangle in main memory */
+#define ECM_MATRIXFREE 1   /* never stored, recomputed from time series */
+#define ECM_OUTOFCORE  2   /* packed lower triangle in a memory-mapped scratch file */
+#define ECM_SPARSE     3   /* thresholded or top-k edges, compressed sparse rows */
+
+#define NBLOCK 256         /* tile size for blocked similarity computations */
+
+/* similarity matrix as seen by the eigensolver */
+typedef struct ECMMatrixStruct {
+  int    mode;             /* storage mode */
+  int    type;             /* scaling of correlations [pos|add|abs|neg] */
+  size_t n;                /* number of voxels */
+  float *A;                /* packed lower triangle, ECM_PACKED */
+  gsl_matrix_float *Z;     /* normalized time series, ECM_MATRIXFREE */
+  int    fd;               /* scratch file, ECM_OUTOFCORE */
+  size_t nwin;             /* number of row windows mapped at a time */
+  size_t *wrow;            /* first row of each window, nwin+1 entries */
+  size_t *rowptr;          /* CSR row pointers, n+1 entries, ECM_SPARSE */
+  unsigned int *col;       /* CSR column indices */
+  float *val;              /* CSR values */
+  double *S;               /* packed sums of products, sliding windows */
+  double *strength;        /* row sums, NULL if not requested */
+  double *degree;          /* entries above dthreshold per row, NULL if not requested */
+  float  dthreshold;       /* threshold for degree */
+} ECMMatrix;
+
+
+/* parcels of a label atlas */
+typedef struct ECMAtlasStruct {
+  size_t nparcels;         /* number of labels inside the mask */
+  int   *labels;           /* label of each parcel, ascending */
+  int   *parcel;           /* parcel of each voxel, -1 if unlabelled */
+  VBoolean project;        /* write parcel values to voxels */
+} ECMAtlas;
+
+
+/* Similarity.c */
+extern void   VNormalizeRows(gsl_matrix_float *X);
+extern float  SimilarityValue(double v,int type);
+extern void   SimilarityTile(const gsl_matrix_float *Z,size_t i0,size_t ni,size_t j0,size_t nj,int type,float *T);
+extern double *DegreeBuffers(ECMMatrix *M,int nthreads);
+extern void   TileDegree(ECMMatrix *M,const float *T,size_t i0,size_t ni,size_t j0,size_t nj,double *buf);
+extern void   DegreeReduce(ECMMatrix *M,double *buf,int nthreads);
+extern void   SimilarityMatrix(ECMMatrix *M,const gsl_matrix_float *Z);
+
+/* MatrixFree.c */
+extern void   MatrixFreeDegree(ECMMatrix *M);
+extern void   MatrixFreeMatVec(ECMMatrix *M,const float *x,float *y);
+
+/* OutOfCore.c */
+extern void   OutOfCoreMatrix(ECMMatrix *M,const gsl_matrix_float *Z,VString scratch,size_t tilemem);
+extern void   OutOfCoreMatVec(ECMMatrix *M,const float *x,float *y);
+extern void   OutOfCoreFree(ECMMatrix *M);
+
+/* Sparse.c */
+extern void   SparseMatrix(ECMMatrix *M,const gsl_matrix_float *Z,float threshold,int topk);
+extern void   SparseMatVec(ECMMatrix *M,const float *x,float *y);
+extern void   SparseFree(ECMMatrix *M);
+
+/* SlidingWindow.c */
+extern float *SlidingWindowECM(ECMMatrix *M,const gsl_matrix_float *Z,size_t wlength,size_t wstride,
+			       int solver,float *ev,VBoolean warmstart,int *nwin);
+
+/* Atlas.c */
+extern ECMAtlas *ParcelMap(VImage atlas,VImage map,VBoolean project);
+extern void   ParcelTimeSeries(ECMAtlas *A,const gsl_matrix_float *X,gsl_matrix_float *P);
+extern void   ParcelToVoxel(ECMAtlas *A,const float *x,float *y,size_t n);
+extern void   VoxelToParcel(ECMAtlas *A,const float *y,float *x,size_t n);
+extern VImage ParcelTable(ECMAtlas *A,const float *x);
+
+/* EigenvectorCentrality.c */
+extern void   PackedRowsMatVec(const float *A,size_t r0,size_t r1,const float *x,float *ybuf,size_t n,int nthreads);
+extern void   ReduceThreadBuffers(const float *ybuf,float *y,size_t n,int nthreads);
+extern void   PackedMatVec(float *A,const float *x,float *y,size_t n);
+extern void   VMatVec(ECMMatrix *M,const float *x,float *y);
+extern void   EigenvectorCentrality(ECMMatrix *M,float *ev,int solver,VBoolean warmstart);
@@ -17,18 +17,14 @@
 #include <viaio/file.h>
 #include <viaio/mu.h>
 #include <viaio/option.h>
+#include <via/via.h>
 
 #define SQR(x) ((x)*(x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
-VImage VEdge2Image(VBundle ebundle,VBundle ibundle,VBundle jbundle,long nedges,VImage pointmap,VImage roi,VFloat xmin,VFloat xmax)
+/* alloc dest image */
+VImage VEdgeImage(VImage pointmap)
 {
-  float *E = ebundle->data;
-  int *I = ibundle->data;
-  int *J = jbundle->data;
- 
-
-  /* alloc dest image */
   int nrows   = (int)VPixel(pointmap,0,3,1,VShort);  /* nrows */
   int ncols   = (int)VPixel(pointmap,0,3,2,VShort);  /* ncols */
   int nslices = (int)VPixel(pointmap,0,3,0,VShort);  /* nslices */
@@ -37,16 +33,20 @@ VImage VEdge2Image(VBundle ebundle,VBundle ibundle,VBundle jbundle,long nedges,V
   VFillImage(dest,VAllBands,0);
   VCopyImageAttrs (pointmap,dest);
   fprintf(stderr," nvox: %d\n",nvox);
+  return dest;
+}
 
 
-  /* map to image */
+/* add edges to dest, nx counts the edges that pass the thresholds, mx all edges */
+void VEdge2Image(VImage dest,float *E,int *I,int *J,long nedges,VImage pointmap,VImage roi,
+		 VFloat xmin,VFloat xmax,double *nx,double *mx)
+{
   long e=0;
-  double nx=0,mx=0;
   for (e=0; e<nedges; e++) {
     int i = I[e];
     int j = J[e];
     float z = E[e];
-    mx++;
+    (*mx)++;
 
     /* apply threshold */
     if (z < xmin || z > xmax) continue;
@@ -70,12 +70,8 @@ VImage VEdge2Image(VBundle ebundle,VBundle ibundle,VBundle jbundle,long nedges,V
     float v = VPixel(dest,bj,rj,cj,VFloat);
     VPixel(dest,bi,ri,ci,VFloat) = u+1.0;
     VPixel(dest,bj,rj,cj,VFloat) = v+1.0;
-    nx++;
+    (*nx)++;
   }
-  if (nx < 1) VError(" no voxels found");
-  fprintf(stderr," nx: %.0lf,  mx: %.0lf,  %lf\n",nx,mx,nx/mx);
-
-  return dest;
 }  
 
 
@@ -122,36 +118,60 @@ int main (int argc,char *argv[])
   }
   
   
-  /* Read the input file: */
-  list = VReadFile (in_file, NULL);
-  if (! list) exit (1);
-  
-  for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
-    str = VGetAttrName(&posn);
-
-    if (strcmp(str,"EdgeDensity") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
-      VGetAttrValue (& posn, NULL, VBundleRepn, & ebundle);
-    }
-    if (strcmp(str,"RowIndex") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
-      VGetAttrValue (& posn, NULL, VBundleRepn, & ibundle);
-    }
-    if (strcmp(str,"ColIndex") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
-      VGetAttrValue (& posn, NULL, VBundleRepn, & jbundle);
-    }
-    if (strcmp(str,"nedges") == 0) {
-      VGetAttrValue (& posn, NULL, VLongRepn, & nedges);
+  /* Read the input file, either a compact edge file or Vista bundles */
+  double nx=0,mx=0;
+  if (VIsEdgeFile(in_file)) {
+    int *I=NULL,*J=NULL;
+    float *E=NULL;
+    size_t n=0;
+    VEdgeFile ef = VEdgeFileOpen(in_file,&list);
+    for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
+      if (strcmp(VGetAttrName(&posn),"map") == 0 && VGetAttrRepn (& posn) == VImageRepn) {
+	VGetAttrValue (& posn, NULL, VImageRepn, & map);
+      }
     }
-    if (strcmp(str,"map") == 0 && VGetAttrRepn (& posn) == VImageRepn) {
-      VGetAttrValue (& posn, NULL, VImageRepn, & map);
+    if (map == NULL) VError(" map not found");
+
+    dest = VEdgeImage(map);
+    while ((n = VEdgeFileRead(ef,&I,&J,&E)) > 0) {
+      VEdge2Image(dest,E,I,J,(long)n,map,roi,xmin,xmax,&nx,&mx);
     }
+    nedges = (VLong)VEdgeFileClose(ef);
+    if (nedges == 0) VError(" no edges");
   }
-  if (ibundle == NULL || jbundle == NULL || ebundle == NULL) VError(" data bundles missing");
-  if (map == NULL) VError(" map not found");
-  if (nedges == 0) VError(" no edges");
+  else {
+    list = VReadFile (in_file, NULL);
+    if (! list) exit (1);
   
+    for (VFirstAttr (list, & posn); VAttrExists (& posn); VNextAttr (& posn)) {
+      str = VGetAttrName(&posn);
+
+      if (strcmp(str,"EdgeDensity") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
+	VGetAttrValue (& posn, NULL, VBundleRepn, & ebundle);
+      }
+      if (strcmp(str,"RowIndex") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
+	VGetAttrValue (& posn, NULL, VBundleRepn, & ibundle);
+      }
+      if (strcmp(str,"ColIndex") == 0 && VGetAttrRepn (& posn) == VBundleRepn) {
+	VGetAttrValue (& posn, NULL, VBundleRepn, & jbundle);
+      }
+      if (strcmp(str,"nedges") == 0) {
+	VGetAttrValue (& posn, NULL, VLongRepn, & nedges);
+      }
+      if (strcmp(str,"map") == 0 && VGetAttrRepn (& posn) == VImageRepn) {
+	VGetAttrValue (& posn, NULL, VImageRepn, & map);
+      }
+    }
+    if (ibundle == NULL || jbundle == NULL || ebundle == NULL) VError(" data bundles missing");
+    if (map == NULL) VError(" map not found");
+    if (nedges == 0) VError(" no edges");
 
-  /* map to image */
-  dest = VEdge2Image(ebundle,ibundle,jbundle,(long)nedges,map,roi,xmin,xmax);
+    /* map to image */
+    dest = VEdgeImage(map);
+    VEdge2Image(dest,ebundle->data,ibundle->data,jbundle->data,(long)nedges,map,roi,xmin,xmax,&nx,&mx);
+  }
+  if (nx < 1) VError(" no voxels found");
+  fprintf(stderr," nx: %.0lf,  mx: %.0lf,  %lf\n",nx,mx,nx/mx);
   
 
   /* update geoinfo */
@@ -0,0 +1,143 @@
+/*
+** voxel neighbourhoods as a table in compressed sparse row format.
+** The table is built once from the voxel map, the edge density
+** computations then scan integer arrays instead of looking up
+** voxel addresses in an image.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_histogram.h>
+
+#include "viaio/Vlib.h"
+#include "viaio/VImage.h"
+#include "viaio/mu.h"
+
+#include "vted.h"
+
+#define ABS(x) ((x) > 0 ? (x) : -(x))
+
+
+/* number of voxels in a neighbourhood including the center */
+int AdjacencySize(int adjdef)
+{
+  if (adjdef == 0) return 7;
+  else if (adjdef == 1) return 19;
+  else if (adjdef == 2) return 27;
+  else if (adjdef == 3) return 33;
+  VError(" illegal adjdef %d",adjdef);
+  return 0;
+}
+
+
+/*
+** neighbours of voxel id in scan order, voxels outside the mask are skipped.
+** Voxels at the border of the volume have no neighbourhood.
+*/
+int Neighbours(size_t id,VImage map,VImage mapimage,int adjdef,int *x)
+{
+  int nslices = VImageNBands(mapimage);
+  int nrows = VImageNRows(mapimage);
+  int ncols = VImageNColumns(mapimage);
+
+  int bi = VPixel(map,0,0,id,VShort);
+  int ri = VPixel(map,0,1,id,VShort);
+  int ci = VPixel(map,0,2,id,VShort);
+  if (bi < 1 || bi >= nslices-2) return 0;
+  if (ri < 1 || ri >= nrows-2) return 0;
+  if (ci < 1 || ci >= ncols-2) return 0;
+
+  int wn=1,rad2=0;
+  if (adjdef == 3) {
+    wn = 2;
+    rad2 = 2*2;
+  }
+
+  int n=0;
+  int k,l,m;
+  for (m=-wn; m<=wn; m++) {
+    for (k=-wn; k<=wn; k++) {
+      for (l=-wn; l<=wn; l++) {
+	int b = bi+m;
+	int r = ri+k;
+	int c = ci+l;
+	if (b < 0 || r < 0 || c < 0) continue;
+	if (b >= nslices || r >= nrows || c >= ncols) continue;
+	int jj = (int)VPixel(mapimage,b,r,c,VInteger);
+	if (jj < 0) continue;  /* outside of brain mask */
+
+	if (adjdef == 0) {     /* 6 adjacency */
+	  if (ABS(m)+ABS(k)+ABS(l) > 1) continue;
+	}
+	if (adjdef == 1) {     /* 18-adjacency */
+	  if (ABS(m) > 0 && ABS(k) > 0 && ABS(l) > 0) continue;
+	}
+	if (adjdef == 3) {     /* sphere */
+	  if (m*m + k*k + l*l > rad2) continue;
+	}
+	if (x) x[n] = jj;
+	n++;
+      }
+    }
+  }
+  return n;
+}
+
+
+TEDAdjacency *VAdjacency(VImage map,int nslices,int nrows,int ncols,int adjdef)
+{
+  size_t i,nvox = VImageNColumns(map);
+  int b,r,c,k;
+
+  TEDAdjacency *adj = (TEDAdjacency *) VCalloc(1,sizeof(TEDAdjacency));
+  adj->nvox = nvox;
+  adj->adjdef = adjdef;
+  adj->maxadj = AdjacencySize(adjdef);
+  adj->off = (size_t *) VCalloc(nvox+1,sizeof(size_t));
+
+  /* voxel addresses */
+  VImage mapimage = VCreateImage(nslices,nrows,ncols,VIntegerRepn);
+  VFillImage(mapimage,VAllBands,(VInteger)(-1));
+  for (i=0; i<nvox; i++) {
+    b = VPixel(map,0,0,i,VShort);
+    r = VPixel(map,0,1,i,VShort);
+    c = VPixel(map,0,2,i,VShort);
+    VPixel(mapimage,b,r,c,VInteger) = (VInteger)i;
+  }
+
+  /* neighbourhood sizes, then offsets */
+  for (i=0; i<nvox; i++) adj->off[i+1] = (size_t)Neighbours(i,map,mapimage,adjdef,NULL);
+  for (i=0; i<nvox; i++) adj->off[i+1] += adj->off[i];
+  adj->nbr = (int *) VCalloc(adj->off[nvox]+1,sizeof(int));
+
+  adj->span = 0;
+  for (i=0; i<nvox; i++) {
+    int *x = &adj->nbr[adj->off[i]];
+    int n = Neighbours(i,map,mapimage,adjdef,x);
+    if (n < 1) continue;
+    int imin = x[0], imax = x[0];
+    for (k=1; k<n; k++) {
+      if (x[k] < imin) imin = x[k];
+      if (x[k] > imax) imax = x[k];
+    }
+    if ((size_t)(imax-imin) > adj->span) adj->span = (size_t)(imax-imin);
+  }
+  VDestroyImage(mapimage);
+
+  fprintf(stderr," adjacency: %ld neighbours, %.2f MB\n",(long)adj->off[nvox],
+	  (double)((nvox+1)*sizeof(size_t) + adj->off[nvox]*sizeof(int))/(1000.0*1000.0));
+  return adj;
+}
+
+
+void VAdjacencyFree(TEDAdjacency *adj)
+{
+  if (adj == NULL) return;
+  VFree(adj->off);
+  VFree(adj->nbr);
+  VFree(adj);
+}
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <sched.h>
 
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_vector.h>
@@ -22,6 +23,9 @@
 #include "viaio/Vlib.h"
 #include "viaio/VImage.h"
 #include "viaio/mu.h"
+#include "via/via.h"
+
+#include "vted.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -30,80 +34,217 @@
 #define SQR(x) ((x) * (x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
+#define ROWBLOCK 32   /* rows of the edge matrix per edge buffer */
+#define MAXPENDING 4  /* blocks per thread that may wait to be written */
+
 extern void GetRank(float *data,gsl_vector *v,gsl_permutation *perm,gsl_permutation *rank);
 extern float EdgeCorr(const float *data1,const float *data2,int,int);
 
 
-int GetAddr(VImage mapimage,int bi,int ri,int ci,int m,int k,int l)
+void VCheckImage(VImage src)
+{
+  VAttrList out_list = VCreateAttrList();
+  VAppendAttr(out_list,"image",NULL,VImageRepn,src);
+  FILE *out_file = fopen("test.v","w");
+  VWriteFile (out_file, out_list);
+}
+
+
+/*
+** Per-thread cache of neighbourhood pairs for the current row i.
+** A slot holds voxel jj and one code per neighbour x[s] of i:
+** 0 - pair is skipped, 1 - pair counts, 2 - pair counts and is above threshold.
+** Slots are addressed by jj modulo the cache size, which exceeds the index
+** span of any neighbourhood, so that the neighbourhoods of nearby j share slots.
+*/
+typedef struct PairCacheStruct {
+  size_t size;            /* number of slots, power of two */
+  int nadj;               /* codes per slot */
+  long *row;              /* row i the slot belongs to, -1 if empty */
+  int *tag;               /* voxel jj held in the slot */
+  unsigned char *code;
+} PairCache;
+
+
+PairCache *PairCacheAlloc(size_t span,int nadj)
+{
+  size_t k;
+  PairCache *C = (PairCache *) VCalloc(1,sizeof(PairCache));
+  C->size = 1024;
+  while (C->size < 4*(span+1)) C->size *= 2;
+  C->nadj = nadj;
+  C->row  = (long *) VCalloc(C->size,sizeof(long));
+  C->tag  = (int *) VCalloc(C->size,sizeof(int));
+  C->code = (unsigned char *) VCalloc(C->size*nadj,sizeof(unsigned char));
+  for (k=0; k<C->size; k++) C->row[k] = -1;
+  return C;
+}
+
+
+void PairCacheFree(PairCache *C)
+{
+  VFree(C->row);
+  VFree(C->tag);
+  VFree(C->code);
+  VFree(C);
+}
+
+
+/* codes of the pairs (x[s],jj) in row i, computed on a cache miss only */
+const unsigned char *PairCodes(PairCache *C,size_t i,size_t jj,const int *x,int nadjx,
+			       gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,VImage map,
+			       int rad2,float zthreshold,int metric)
+{
+  size_t slot = jj & (C->size-1);
+  unsigned char *code = &C->code[slot*C->nadj];
+  int s,nt = SNR1->size2;
+  float tiny=1.0e-6;
+
+  if (C->row[slot] == (long)i && C->tag[slot] == (int)jj) return code;
+  C->row[slot] = (long)i;
+  C->tag[slot] = (int)jj;
+
+  int bjj = (int)VPixel(map,0,0,jj,VShort);
+  int rjj = (int)VPixel(map,0,1,jj,VShort);
+  int cjj = (int)VPixel(map,0,2,jj,VShort);
+  const float *datayy1 = gsl_matrix_float_const_ptr(SNR1,jj,0);
+  const float *datayy2 = gsl_matrix_float_const_ptr(SNR2,jj,0);
+
+  for (s=0; s<nadjx; s++) {
+    size_t ii = (size_t) x[s];
+    int bii = (int)VPixel(map,0,0,ii,VShort);
+    int rii = (int)VPixel(map,0,1,ii,VShort);
+    int cii = (int)VPixel(map,0,2,ii,VShort);
+    code[s] = 0;
+
+    int d2 = SQR(bii-bjj) + SQR(rii-rjj) + SQR(cii-cjj);
+    if (d2 < rad2) continue;
+
+    const float *dataxx1 = gsl_matrix_float_const_ptr(SNR1,ii,0);
+    const float *dataxx2 = gsl_matrix_float_const_ptr(SNR2,ii,0);
+
+    /* edge z-value */
+    double z1 = EdgeCorr(dataxx1,datayy1,nt,metric);
+    double z2 = EdgeCorr(dataxx2,datayy2,nt,metric);
+    double z = (z1-z2);
+    if (ABS(z) < tiny) continue;
+    code[s] = (z > zthreshold) ? 2 : 1;
+  }
+  return code;
+}
+
+
+/*
+** Edges of a block of consecutive rows. Each block is processed by one
+** thread, the blocks are concatenated in row order afterwards, so that
+** the output does not depend on the number of threads.
+*/
+typedef struct EdgeBufferStruct {
+  size_t nedges;
+  size_t cap;
+  float *E;
+  int *I;
+  int *J;
+} EdgeBuffer;
+
+
+void EdgeAppend(EdgeBuffer *buf,float e,int i,int j)
 {
-  int b = bi+m;
-  int r = ri+k;
-  int c = ci+l;
-  if (b < 0 || r < 0 || c < 0) return -1;
-  if (b >= VImageNBands(mapimage) || r >= VImageNRows(mapimage) || c >= VImageNColumns(mapimage)) return -1;
-  int ii = (long)VPixel(mapimage,b,r,c,VInteger);
-  return ii;
+  if (buf->nedges >= buf->cap) {
+    buf->cap = (buf->cap < 1024) ? 1024 : 2*buf->cap;
+    buf->E = (float *) VRealloc(buf->E,buf->cap*sizeof(float));
+    buf->I = (int *) VRealloc(buf->I,buf->cap*sizeof(int));
+    buf->J = (int *) VRealloc(buf->J,buf->cap*sizeof(int));
+  }
+  buf->E[buf->nedges] = e;
+  buf->I[buf->nedges] = i;
+  buf->J[buf->nedges] = j;
+  buf->nedges++;
 }
 
-int VEdgeNeigbours(size_t id,VImage map,VImage mapimage,int adjdef,int *x)
+
+/* copy buffers to E,I,J at offsets given by an exclusive prefix sum, frees the buffers */
+size_t EdgeConcat(EdgeBuffer *buf,size_t nblocks,float *E,int *I,int *J,size_t nedges_estimated)
 {
-  int nslices = VImageNBands(mapimage);
-  int nrows = VImageNRows(mapimage);
-  int ncols = VImageNColumns(mapimage);
-
-  int bi = VPixel(map,0,0,id,VShort);
-  int ri = VPixel(map,0,1,id,VShort);
-  int ci = VPixel(map,0,2,id,VShort);
-  if (bi < 1 || bi >= nslices-2) return 0;
-  if (ri < 1 || ri >= nrows-2) return 0;
-  if (ci < 1 || ci >= ncols-2) return 0;
-
-  int wn=1,rad2=0;
-  if (adjdef == 3) {
-    wn = 2;
-    rad2 = 2*2;
+  size_t b,nedges=0;
+  size_t *offset = (size_t *) VCalloc(nblocks+1,sizeof(size_t));
+
+  for (b=0; b<nblocks; b++) offset[b+1] = offset[b] + buf[b].nedges;
+  nedges = offset[nblocks];
+  if (nedges > nedges_estimated) {
+    VError(" alloc, nedges_estimated:  %lu",nedges_estimated);
   }
 
-  int n=0;
-  int k,l,m;
-  for (m=-wn; m<=wn; m++) {
-    for (k=-wn; k<=wn; k++) {
-      for (l=-wn; l<=wn; l++) {
-      	int jj = GetAddr(mapimage,bi,ri,ci,m,k,l);
-      	if (jj < 0) continue;  /* outside of brain mask */
-
-      	if (adjdef == 0) {     /* 6 adjacency */
-      	  if (ABS(m)+ABS(k)+ABS(l) > 1) continue;
-      	}
-      	if (adjdef == 1) {     /* 18-adjacency */
-      	  if (ABS(m) > 0 && ABS(k) > 0 && ABS(l) > 0) continue;
-      	}	
-	if (adjdef == 3) {     /* sphere */
-	  if (m*m + k*k + l*l > rad2) continue;
-	}
-      	x[n] = jj;
-      	n++;
-      }
+#pragma omp parallel for schedule(dynamic)
+  for (b=0; b<nblocks; b++) {
+    size_t k = offset[b];
+    if (buf[b].nedges > 0) {
+      memcpy(&E[k],buf[b].E,buf[b].nedges*sizeof(float));  /* task-based edge density */
+      memcpy(&I[k],buf[b].I,buf[b].nedges*sizeof(int));    /* voxel address i */
+      memcpy(&J[k],buf[b].J,buf[b].nedges*sizeof(int));    /* voxel address j */
     }
+    VFree(buf[b].E);
+    VFree(buf[b].I);
+    VFree(buf[b].J);
   }
-  return n;
+  VFree(offset);
+  return nedges;
 }
 
-void VCheckImage(VImage src)
+
+/*
+** write the edges of one completed block, its buffer is freed.
+*/
+void EdgeWriteBlock(EdgeBuffer *eb,VEdgeFile ef)
 {
-  VAttrList out_list = VCreateAttrList();
-  VAppendAttr(out_list,"image",NULL,VImageRepn,src);
-  FILE *out_file = fopen("test.v","w");
-  VWriteFile (out_file, out_list);
+  size_t k;
+  for (k=0; k<eb->nedges; k++) VEdgeFileWrite(ef,eb->I[k],eb->J[k],eb->E[k]);
+  VFree(eb->E);
+  VFree(eb->I);
+  VFree(eb->J);
+  eb->E = NULL;
+  eb->I = NULL;
+  eb->J = NULL;
+}
+
+
+/* scratch space of EdgeDensity, one per thread, allocated once per call */
+typedef struct EdgeWorkStruct {
+  PairCache *cache;       /* pair codes of the current row */
+  gsl_histogram *hist;    /* edge densities seen by this thread */
+} EdgeWork;
+
+
+EdgeWork *EdgeWorkspace(TEDAdjacency *adj,gsl_histogram *TedHist)
+{
+  EdgeWork *work = (EdgeWork *) VCalloc(1,sizeof(EdgeWork));
+  work->cache = PairCacheAlloc(adj->span,adj->maxadj);
+  work->hist = gsl_histogram_clone(TedHist);
+  gsl_histogram_reset(work->hist);
+  return work;
+}
+
+
+void EdgeWorkFree(EdgeWork *work)
+{
+  PairCacheFree(work->cache);
+  gsl_histogram_free(work->hist);
+  VFree(work);
 }
 
 
-size_t EdgeDensity(float *E,int *I,int *J,size_t nedges_estimated,
+/*
+** Edges of the last permutation are either collected in E,I,J, or, if 'ef' is given,
+** written to 'ef' as soon as all preceding blocks of rows are complete.
+** Only one thread writes at a time, the others continue computing. A block is not
+** started while more than MAXPENDING blocks per thread still wait to be written.
+*/
+size_t EdgeDensity(float *E,int *I,int *J,size_t nedges_estimated,VEdgeFile ef,
 		   gsl_histogram *TedHist,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-		   VImage roi,VImage map,VImage mapimage,int adjdef,float elength,float zthreshold,
+		   TEDRoi *roi,VImage map,TEDAdjacency *adj,TEDCandidates *cand,float elength,float zthreshold,
 		   int nperm,int numperm,int step,float noise_cutoff,int metric)
 {
-  size_t i;
+  size_t blk;
   size_t nvox=SNR1->size1;
   int nt=SNR1->size2;
   size_t progress=0;
@@ -113,152 +254,172 @@ size_t EdgeDensity(float *E,int *I,int *J,size_t nedges_estimated,
 
   int iisel=4;
 
-  /* size of neighbourhood */
-  int nadj=0;
-  if (adjdef == 0) nadj = 7;
-  else if (adjdef == 1) nadj = 19;
-  else if (adjdef == 2) nadj = 27;
-  else if (adjdef == 3) nadj = 33;
-  else VError(" illegal adjdef %d",adjdef);
   size_t nedges=0;
   int minadj = 1;
 
-  /* histogram init */
-  size_t nbins = gsl_histogram_bins (TedHist);
+  /* histogram range */
   double hmax = gsl_histogram_max (TedHist);
   double hmin = gsl_histogram_min (TedHist);
 
+  /* one edge buffer per block of rows */
+  size_t nrows = (nvox+step-1)/step;
+  size_t nblocks = (nrows+ROWBLOCK-1)/ROWBLOCK;
+  EdgeBuffer *buf = (EdgeBuffer *) VCalloc(nblocks,sizeof(EdgeBuffer));
 
-#pragma omp parallel for shared(nedges,progress,TedHist,E,I,J) schedule(dynamic)
-  for (i=0; i<nvox; i+=step) {
-    if (i%1000 == 0) fprintf(stderr," %ld000\r",(long)progress++);
+  /* blocks already computed, the first block not yet written, and whether a thread is writing */
+  if (nperm != numperm) ef = NULL;
+  char *done = NULL;
+  size_t next = 0;
+  int writing = 0;
+  if (ef != NULL) done = (char *) VCalloc(nblocks,sizeof(char));
 
-    int bi = (int)VPixel(map,0,0,i,VShort);
-    int ri = (int)VPixel(map,0,1,i,VShort);
-    int ci = (int)VPixel(map,0,2,i,VShort);
 
-    int iselect=0;
-
-    int roiflagi = 0;
-    if (roi != NULL) {
-      if (VGetPixel(roi,bi,ri,ci) > 0.5) roiflagi = 1;
+#pragma omp parallel shared(progress,TedHist,buf,next,writing)
+  {
+  EdgeWork *work = EdgeWorkspace(adj,TedHist);
+  size_t window = MAXPENDING;
+#ifdef _OPENMP
+  window *= (size_t)omp_get_num_threads();
+#endif
+
+#pragma omp for schedule(monotonic:dynamic)
+  for (blk=0; blk<nblocks; blk++) {
+    EdgeBuffer *eb = &buf[blk];
+    size_t q,w;
+    if (ef != NULL) {
+      /* the monotonic schedule hands out blocks in increasing order, so the first unwritten
+	 block has already been claimed by a thread that does not wait */
+      do {
+#pragma omp atomic read
+	w = next;
+	if (blk >= w + window) sched_yield();
+      } while (blk >= w + window);
     }
+    if (blk%16 == 0) fprintf(stderr," %ld of %ld\r",(long)progress++,(long)(nblocks+15)/16);
 
-    const float *datax1 = gsl_matrix_float_const_ptr(SNR1,i,0);
-    const float *datax2 = gsl_matrix_float_const_ptr(SNR2,i,0);
-
-    int *x = (int *) VCalloc(nadj,sizeof(int));
-    int *y = (int *) VCalloc(nadj,sizeof(int));
+    for (q=blk*ROWBLOCK; q<(blk+1)*ROWBLOCK && q<nrows; q++) {
+      size_t i = q*(size_t)step;
+      int bi = (int)VPixel(map,0,0,i,VShort);
+      int ri = (int)VPixel(map,0,1,i,VShort);
+      int ci = (int)VPixel(map,0,2,i,VShort);
 
-    gsl_histogram *tmphist = gsl_histogram_alloc (nbins);
-    gsl_histogram_set_ranges_uniform (tmphist,hmin,hmax);
-    gsl_histogram_reset(tmphist);
+      int iselect=0;
 
-    int nadjx = VEdgeNeigbours(i,map,mapimage,adjdef,x);
-    if (nadjx < minadj) continue;
+      const float *datax1 = gsl_matrix_float_const_ptr(SNR1,i,0);
+      const float *datax2 = gsl_matrix_float_const_ptr(SNR2,i,0);
 
-    size_t j=0;
-    for (j=0; j<i; j+=step) {
-      int bj = (int)VPixel(map,0,0,j,VShort);
-      int rj = (int)VPixel(map,0,1,j,VShort);
-      int cj = (int)VPixel(map,0,2,j,VShort);
-      int d = SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj);
-      if (d < rad2) continue;
+      const int *x = &adj->nbr[adj->off[i]];
+      int nadjx = (int)(adj->off[i+1] - adj->off[i]);
+      if (nadjx < minadj) continue;
 
-      int roiflagj = 0;
-      if (roi != NULL) {
-	if (VGetPixel(roi,bj,rj,cj) > 0.5) roiflagj = 1;
-	if (roiflagi + roiflagj != 1) continue; 
+      /* candidates of the fused pass, in ROI mode voxels on the other side of the ROI border, or all pairs */
+      size_t j=0,k,kmax;
+      const int *jlist = NULL;
+      if (cand != NULL) {
+	jlist = &cand->col[cand->off[i]];
+	kmax = cand->off[i+1] - cand->off[i];
       }
+      else if (roi != NULL) jlist = VRoiPartners(roi,i,&kmax);
+      else kmax = (i+step-1)/step;
 
-      const float *datay1 = gsl_matrix_float_const_ptr(SNR1,j,0);
-      const float *datay2 = gsl_matrix_float_const_ptr(SNR2,j,0);
+      for (k=0; k<kmax; k++) {
+	j = (jlist != NULL) ? (size_t)jlist[k] : k*step;
+	if (cand == NULL && j%step != 0) continue;
+	int bj = (int)VPixel(map,0,0,j,VShort);
+	int rj = (int)VPixel(map,0,1,j,VShort);
+	int cj = (int)VPixel(map,0,2,j,VShort);
+	int d = SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj);
+	if (d < rad2) continue;
+
+	const float *datay1 = gsl_matrix_float_const_ptr(SNR1,j,0);
+	const float *datay2 = gsl_matrix_float_const_ptr(SNR2,j,0);
 
  
-      /* edge z-value */
-      double z1 = EdgeCorr(datax1,datay1,nt,metric);
-      double z2 = EdgeCorr(datax2,datay2,nt,metric);
-      double z = (z1-z2);
-      if (z < zthreshold) continue;
+	/* edge z-value */
+	double z1 = EdgeCorr(datax1,datay1,nt,metric);
+	double z2 = EdgeCorr(datax2,datay2,nt,metric);
+	double z = (z1-z2);
+	if (z < zthreshold) continue;
  
-      int nadjy = VEdgeNeigbours(j,map,mapimage,adjdef,y);
-      if (nadjy < minadj) continue;
+	const int *y = &adj->nbr[adj->off[j]];
+	int nadjy = (int)(adj->off[j+1] - adj->off[j]);
+	if (nadjy < minadj) continue;
 
 
-      /* use every 'step' value, only when estimating noise cutoff, i.e. step > 1 */
-      if (iselect%iisel == 0 && step > 1) {
-	iselect = 0;
-      }
-      else if (iselect%iisel != 0 && step > 1) {
-	iselect++;
-	continue;
-      }
+	/* use every 'step' value, only when estimating noise cutoff, i.e. step > 1 */
+	if (iselect%iisel == 0 && step > 1) {
+	  iselect = 0;
+	}
+	else if (iselect%iisel != 0 && step > 1) {
+	  iselect++;
+	  continue;
+	}
 
 
-      /* inspect local neighbourhood */
-      int r,s;
-      double kx=0.0,nx=0.0;
-      for (s=0; s<nadjx; s++) {
-      	size_t ii = (size_t) x[s];
-        int bii = (int)VPixel(map,0,0,ii,VShort);
-        int rii = (int)VPixel(map,0,1,ii,VShort);
-        int cii = (int)VPixel(map,0,2,ii,VShort);
-
-	const float *dataxx1 = gsl_matrix_float_const_ptr(SNR1,ii,0);
-	const float *dataxx2 = gsl_matrix_float_const_ptr(SNR2,ii,0);
-
-      	for (r=0; r<nadjy; r++) {
-      	  size_t jj = (size_t) y[r];
-          int bjj = (int)VPixel(map,0,0,jj,VShort);
-          int rjj = (int)VPixel(map,0,1,jj,VShort);
-          int cjj = (int)VPixel(map,0,2,jj,VShort);
-
-          int d2 = SQR(bii-bjj) + SQR(rii-rjj) + SQR(cii-cjj);
-          if (d2 < rad2) continue;
-
-	  const float *datayy1 = gsl_matrix_float_const_ptr(SNR1,jj,0);
-	  const float *datayy2 = gsl_matrix_float_const_ptr(SNR2,jj,0);
-
-	  /* edge z-value */
-	  double z1 = EdgeCorr(dataxx1,datayy1,nt,metric);
-	  double z2 = EdgeCorr(dataxx2,datayy2,nt,metric);
-	  double z = (z1-z2);
-          if (ABS(z) < tiny) continue;
-      	  if (z > zthreshold) kx++;
-          nx++;
-     	}
-      }
-      if (nx < 1.0) continue;
-      double ted = kx/nx;
+	/* inspect local neighbourhood */
+	int r,s;
+	double kx=0.0,nx=0.0;
+	for (r=0; r<nadjy; r++) {
+	  const unsigned char *code = PairCodes(work->cache,i,(size_t)y[r],x,nadjx,SNR1,SNR2,map,
+						rad2,zthreshold,metric);
+	  for (s=0; s<nadjx; s++) {
+	    if (code[s] == 0) continue;
+	    if (code[s] == 2) kx++;
+	    nx++;
+	  }
+	}
+	if (nx < 1.0) continue;
+	double ted = kx/nx;
 
-      if (ted < hmin) ted = hmin;
-      if (ted > hmax-tiny) ted = hmax-tiny;
-      gsl_histogram_increment (tmphist,ted);
+	if (ted < hmin) ted = hmin;
+	if (ted > hmax-tiny) ted = hmax-tiny;
+	gsl_histogram_increment (work->hist,ted);
 
-      if (E == NULL) continue;
-      if (nperm != numperm) continue;
-      if (ted < noise_cutoff) continue;
+	if (E == NULL && ef == NULL) continue;
+	if (nperm != numperm) continue;
+	if (ted < noise_cutoff) continue;
 
 
-      #pragma omp critical 
+	EdgeAppend(eb,(float)ted,(int)i,(int)j);
+      }
+      }
+
+    /* the thread that completes the first unwritten block writes until it meets a gap */
+    if (ef != NULL) {
+      int writer = 0;
+#pragma omp critical(edgeflush)
       {
-	if (nedges >= nedges_estimated) {
-	  VError(" alloc, nedges_estimated:  %lu",nedges_estimated);
+	done[blk] = 1;
+	if (!writing && done[next]) writing = writer = 1;
+      }
+      while (writer) {
+	size_t b = next;
+	EdgeWriteBlock(&buf[b],ef);
+	b++;
+#pragma omp critical(edgeflush)
+	{
+#pragma omp atomic write
+	  next = b;
+	  if (b == nblocks || !done[b]) writing = writer = 0;
 	}
-	E[nedges] = ted;    /* task-based edge density */
-	I[nedges] = i;      /* voxel address i */
-	J[nedges] = j;      /* voxel address j */
-	nedges++;
       }
     }
-#pragma omp critical 
-    {
-      gsl_histogram_add (TedHist,tmphist);
-    }
-    gsl_histogram_free (tmphist);
-    VFree(x);
-    VFree(y);
   }
+#pragma omp critical
+  {
+    gsl_histogram_add (TedHist,work->hist);
+  }
+  EdgeWorkFree(work);
+  }
+
+  /* concatenate buffers in row order */
+  if (ef != NULL) {
+    for (blk=0; blk<nblocks; blk++) nedges += buf[blk].nedges;
+    VFree(done);
+  }
+  else
+    nedges = EdgeConcat(buf,nblocks,E,I,J,nedges_estimated);
+  VFree(buf);
   return nedges;
 }
 
@@ -266,7 +427,7 @@ size_t EdgeDensity(float *E,int *I,int *J,size_t nedges_estimated,
 /* estimate number of truly needed edges */
 size_t EstimateEdges(float *E,int *I,int *J,size_t old_estimate,
 		     gsl_histogram *TedHist,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-		     VImage roi,VImage map,VImage mapimage,int adjdef,float elength,float zthr,
+		     TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float zthr,
 		     float noise_cutoff,int metric)
 {
   float tmp_cutoff = -1.0;
@@ -274,7 +435,7 @@ size_t EstimateEdges(float *E,int *I,int *J,size_t old_estimate,
   int nperm=0,numperm=1;
 
   gsl_histogram_reset(TedHist);
-  EdgeDensity(E,I,J,old_estimate,TedHist,SNR1,SNR2,n1,n2,roi,map,mapimage,(int)adjdef,elength,zthr,
+  EdgeDensity(E,I,J,old_estimate,NULL,TedHist,SNR1,SNR2,n1,n2,roi,map,adj,NULL,elength,zthr,
 	      nperm,numperm,step,tmp_cutoff,metric);
 
   double sd = gsl_histogram_sigma (TedHist);
@@ -18,54 +18,77 @@
 #include <gsl/gsl_permutation.h>
 #include <gsl/gsl_sort_vector.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif /*_OPENMP*/
+
 extern void VNormalize(float *data,int nt,VBoolean stddev);
 extern void GetRank(float *data,gsl_vector *v,gsl_permutation *perm,gsl_permutation *rank);
+extern float kth_smallest(float *a,size_t n,size_t k);
+
+
+/* median of n values by selection, the values are reordered */
+double SelectMedian(float *data,size_t n)
+{
+  size_t i,k = n/2;
+  if (n%2 == 1) return (double)kth_smallest(data,n,k);
+
+  /* even n: mean of the two middle values, data[k...n-1] are not below data[k-1] */
+  double lower = (double)kth_smallest(data,n,k-1);
+  float upper = data[k];
+  for (i=k+1; i<n; i++) if (data[i] < upper) upper = data[i];
+  return 0.5*(lower + (double)upper);
+}
+
 
 void GetMedian(gsl_matrix_float **X1,gsl_matrix_float **X2,int *table,int n,gsl_matrix_float *SNR,int metric)
 {
   long j,nvox=X1[0]->size1;
-  long k,s,nt=X1[0]->size2;
+  long nt=X1[0]->size2;
 
-  double *data = (double *) VCalloc(n,sizeof(double));
-  double median = 0;
+#pragma omp parallel
+  {
+    long k,s;
+    float *data = (float *) VCalloc(n,sizeof(float));
+    double median = 0;
 
-  gsl_vector *vec = NULL;
-  gsl_permutation *perm = NULL;
-  gsl_permutation *rank = NULL;
-  if (metric == 1) {
-    vec = gsl_vector_calloc(nt);
-    perm = gsl_permutation_alloc(nt);
-    rank = gsl_permutation_alloc(nt);
-  }
+    gsl_vector *vec = NULL;
+    gsl_permutation *perm = NULL;
+    gsl_permutation *rank = NULL;
+    if (metric == 1) {
+      vec = gsl_vector_calloc(nt);
+      perm = gsl_permutation_alloc(nt);
+      rank = gsl_permutation_alloc(nt);
+    }
 
-  /* for each voxel ... */
-  for (j=0; j<nvox; j++) {
+    /* for each voxel ... */
+#pragma omp for schedule(static)
+    for (j=0; j<nvox; j++) {
+      float *qq = gsl_matrix_float_ptr(SNR,j,0);
 
-    for (k=0; k<nt; k++) {
-      for (s=0; s<n; s++) {
-	if (table[s] == 0)
-	  data[s] = (double)gsl_matrix_float_get(X1[s],j,k);
-	else
-	  data[s] = (double)gsl_matrix_float_get(X2[s],j,k);
+      for (k=0; k<nt; k++) {
+	for (s=0; s<n; s++) {
+	  if (table[s] == 0)
+	    data[s] = gsl_matrix_float_get(X1[s],j,k);
+	  else
+	    data[s] = gsl_matrix_float_get(X2[s],j,k);
+	}
+	median = SelectMedian(data,(size_t)n);
+	qq[k] = (float)median;
+      }
+      if (metric == 0) {  /* pearson correlation */
+	VNormalize(qq,nt,TRUE);
+      }
+      if (metric == 1) {  /* spearman ranks      */
+	GetRank(qq,vec,perm,rank);
       }
-      gsl_sort(data,1,n);
-      median = gsl_stats_median_from_sorted_data (data,1,(size_t) n);
-      gsl_matrix_float_set(SNR,j,k,(float)median);
-    }
-    if (metric == 0) {  /* pearson correlation */
-      float *qq = gsl_matrix_float_ptr(SNR,j,0);
-      VNormalize(qq,nt,TRUE);
-    }
-    if (metric == 1) {  /* spearman ranks      */
-      float *qq = gsl_matrix_float_ptr(SNR,j,0);
-      GetRank(qq,vec,perm,rank);
     }
-  }
-  VFree(data);
+    VFree(data);
 
-  if (metric == 1) {
-    gsl_permutation_free (perm);
-    gsl_permutation_free (rank);
-    gsl_vector_free(vec);
+    if (metric == 1) {
+      gsl_permutation_free (perm);
+      gsl_permutation_free (rank);
+      gsl_vector_free(vec);
+    }
   }
 }
@@ -12,11 +12,14 @@
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_sort.h>
+#include <gsl/gsl_histogram.h>
 
 #include "viaio/Vlib.h"
 #include "viaio/VImage.h"
 #include "viaio/mu.h"
 
+#include "vted.h"
+
 #define SQR(x) ((x) * (x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
@@ -255,3 +258,67 @@ void VDataMatrix(VImage *src,int first,int len,VImage map,gsl_matrix_float *X)
   VFree(data);
 }
 
+
+
+/*
+** index lists of the voxels inside and outside the ROI, so that
+** ROI mode visits only the pairs that join the ROI to its complement
+*/
+TEDRoi *VRoiIndex(VImage roi,VImage map)
+{
+  size_t i,nvox = VImageNColumns(map);
+  int b,r,c;
+
+  TEDRoi *R = (TEDRoi *) VCalloc(1,sizeof(TEDRoi));
+  R->nvox = nvox;
+  R->inside = (char *) VCalloc(nvox,sizeof(char));
+  for (i=0; i<nvox; i++) {
+    b = (int)VPixel(map,0,0,i,VShort);
+    r = (int)VPixel(map,0,1,i,VShort);
+    c = (int)VPixel(map,0,2,i,VShort);
+    if (VGetPixel(roi,b,r,c) > 0.5) {
+      R->inside[i] = 1;
+      R->nin++;
+    }
+  }
+  R->nout = nvox - R->nin;
+  if (R->nin < 1) VError(" roi does not contain any voxels inside the mask");
+  if (R->nout < 1) VError(" roi covers the entire mask");
+
+  R->in  = (int *) VCalloc(R->nin,sizeof(int));
+  R->out = (int *) VCalloc(R->nout,sizeof(int));
+  size_t kin=0,kout=0;
+  for (i=0; i<nvox; i++) {
+    if (R->inside[i]) R->in[kin++] = (int)i;
+    else R->out[kout++] = (int)i;
+  }
+  fprintf(stderr," roi: %ld voxels inside, %ld outside\n",(long)R->nin,(long)R->nout);
+  return R;
+}
+
+
+/* voxels j < i on the other side of the ROI border than voxel i, ascending */
+const int *VRoiPartners(const TEDRoi *roi,size_t i,size_t *n)
+{
+  const int *list = roi->inside[i] ? roi->out : roi->in;
+  size_t lo = 0, hi = roi->inside[i] ? roi->nout : roi->nin;
+
+  /* first entry >= i */
+  while (lo < hi) {
+    size_t mid = (lo+hi)/2;
+    if ((size_t)list[mid] < i) lo = mid+1;
+    else hi = mid;
+  }
+  *n = lo;
+  return list;
+}
+
+
+void VRoiFree(TEDRoi *roi)
+{
+  if (roi == NULL) return;
+  VFree(roi->inside);
+  VFree(roi->in);
+  VFree(roi->out);
+  VFree(roi);
+}
@@ -23,6 +23,10 @@
 #include "viaio/VImage.h"
 #include "viaio/mu.h"
 
+#include "via/via.h"
+
+#include "vted.h"
+
 #ifdef _OPENMP
 #include <omp.h>
 #endif /*_OPENMP*/
@@ -30,51 +34,12 @@
 #define SQR(x) ((x) * (x))
 #define ABS(x) ((x) > 0 ? (x) : -(x))
 
-extern void VNormalize(float *data,int nt,VBoolean stddev);
-extern long GetAddr(VImage mapimage,int bi,int ri,int ci,int m,int k,int l);
+#define ROWBLOCK   32       /* rows per candidate buffer */
+#define PILOTPAIRS 200000   /* voxel pairs sampled for the pre-threshold */
+#define CANDMAX    (1<<25)  /* max number of candidate edges kept by the fused pass */
 
-int VNumNeigbours(size_t id,VImage map,VImage mapimage,int adjdef)
-{
-  int nslices = VImageNBands(mapimage);
-  int nrows = VImageNRows(mapimage);
-  int ncols = VImageNColumns(mapimage);
-
-  int bi = VPixel(map,0,0,id,VShort);
-  int ri = VPixel(map,0,1,id,VShort);
-  int ci = VPixel(map,0,2,id,VShort);
-  if (bi < 1 || bi >= nslices-2) return 0;
-  if (ri < 1 || ri >= nrows-2) return 0;
-  if (ci < 1 || ci >= ncols-2) return 0;
-
-  int wn=1,rad2=0;
-  if (adjdef == 3) {
-    wn = 2;
-    rad2 = 2*2;
-  }
-
-  int n=0;
-  int k,l,m;
-  for (m=-wn; m<=wn; m++) {
-    for (k=-wn; k<=wn; k++) {
-      for (l=-wn; l<=wn; l++) {
-      	long jj = GetAddr(mapimage,bi,ri,ci,m,k,l);
-      	if (jj < 0) continue;  /* outside of brain mask */
-
-      	if (adjdef == 0) {     /* 6 adjacency */
-      	  if (ABS(m)+ABS(k)+ABS(l) > 1) continue;
-      	}
-      	if (adjdef == 1) {     /* 18-adjacency */
-      	  if (ABS(m) > 0 && ABS(k) > 0 && ABS(l) > 0) continue;
-      	}	
-	if (adjdef == 3) {     /* sphere */
-	  if (m*m + k*k + l*l > rad2) continue;
-	}
-      	n++;
-      }
-    }
-  }
-  return n;
-}
+extern void VNormalize(float *data,int nt,VBoolean stddev);
+extern float kth_smallest(float *a,size_t n,size_t k);
 
 /* convert to ranks */
 void GetRank(float *data,gsl_vector *v,gsl_permutation *perm,gsl_permutation *rank)
@@ -104,17 +69,10 @@ double Spearman(const float *data1,const float *data2,int n)
 }
 
 
+/* rows are normalized to unit variance, VCorrDot is the shared SIMD kernel */
 double Correlation(const float *data1,const float *data2,int n)
 {
-  int i;
-  double corr=0;
-  for (i=0; i<n; i++) {   
-    const double u = (double)data1[i];
-    const double v = (double)data2[i];
-    corr += u*v;
-  }
-  corr /= (double)n;
-  return corr;
+  return VCorrDot(data1,data2,(size_t)n)/(double)n;
 }
 
 
@@ -132,65 +90,95 @@ float EdgeCorr(const float *data1,const float *data2,int n,int metric)
 void GetSNR(gsl_matrix_float **X1,gsl_matrix_float **X2,int *table,int n,gsl_matrix_float *SNR,int metric)
 {
   long j,nvox=X1[0]->size1;
-  long k,s,nt=X1[0]->size2;
+  long nt=X1[0]->size2;
 
   if (n < 3) VError(" n: %d",n);
   double nx = (double)n;
-  double *sum1 = (double *)VCalloc(nt,sizeof(double));
-  double *sum2 = (double *)VCalloc(nt,sizeof(double));
-
-  gsl_vector *vec = NULL;
-  gsl_permutation *perm = NULL;
-  gsl_permutation *rank = NULL;
-  if (metric == 1) {  /* only needed for spearman correlation */
-    vec = gsl_vector_calloc(nt);
-    perm = gsl_permutation_alloc(nt);
-    rank = gsl_permutation_alloc(nt);
-  }
 
-  double ave=0,var=0,snr=0;
-
-  for (j=0; j<nvox; j++) {
-    memset(sum1,0,nt*sizeof(double));
-    memset(sum2,0,nt*sizeof(double));
-    const float *pp=NULL;
-    for (s=0; s<n; s++) {
-      if (table[s] == 0)
-	pp = gsl_matrix_float_const_ptr(X1[s],j,0);
-      else
-	pp = gsl_matrix_float_const_ptr(X2[s],j,0);
-      for (k=0; k<nt; k++) {
-	const double x = (double)(*pp++);
-	sum1[k] += x;
-	sum2[k] += x*x;
-      }
-    }
-    for (k=0; k<nt; k++) {
-      ave = (sum1[k]/nx);
-      var = (sum2[k] - nx*ave*ave) / (nx - 1.0);
-      snr = 0;
-      if (var > 0) snr = ave / sqrt(var);
-      gsl_matrix_float_set(SNR,j,k,snr);
+#pragma omp parallel
+  {
+    long k,s;
+    double ave=0,var=0,snr=0;
+    double *sum1 = (double *)VCalloc(nt,sizeof(double));
+    double *sum2 = (double *)VCalloc(nt,sizeof(double));
+
+    gsl_vector *vec = NULL;
+    gsl_permutation *perm = NULL;
+    gsl_permutation *rank = NULL;
+    if (metric == 1) {  /* only needed for spearman correlation */
+      vec = gsl_vector_calloc(nt);
+      perm = gsl_permutation_alloc(nt);
+      rank = gsl_permutation_alloc(nt);
     }
 
-    if (metric == 0) {  /* pearson correlation */
+#pragma omp for schedule(static)
+    for (j=0; j<nvox; j++) {
+      memset(sum1,0,nt*sizeof(double));
+      memset(sum2,0,nt*sizeof(double));
+      const float *pp=NULL;
+      for (s=0; s<n; s++) {
+	if (table[s] == 0)
+	  pp = gsl_matrix_float_const_ptr(X1[s],j,0);
+	else
+	  pp = gsl_matrix_float_const_ptr(X2[s],j,0);
+	for (k=0; k<nt; k++) {
+	  const double x = (double)(*pp++);
+	  sum1[k] += x;
+	  sum2[k] += x*x;
+	}
+      }
       float *qq = gsl_matrix_float_ptr(SNR,j,0);
-      VNormalize(qq,nt,TRUE);
+      for (k=0; k<nt; k++) {
+	ave = (sum1[k]/nx);
+	var = (sum2[k] - nx*ave*ave) / (nx - 1.0);
+	snr = 0;
+	if (var > 0) snr = ave / sqrt(var);
+	qq[k] = (float)snr;
+      }
+
+      if (metric == 0) {  /* pearson correlation */
+	VNormalize(qq,nt,TRUE);
+      }
+      if (metric == 1) {  /* spearman ranks      */
+	GetRank(qq,vec,perm,rank);
+      }
     }
-    if (metric == 1) {  /* spearman ranks      */
-      float *qq = gsl_matrix_float_ptr(SNR,j,0);
-      GetRank(qq,vec,perm,rank);
+    VFree(sum1);
+    VFree(sum2);
+    if (metric == 1) {
+      gsl_permutation_free (perm);
+      gsl_permutation_free (rank);
+      gsl_vector_free(vec);
     }
   }
-  VFree(sum1);
-  VFree(sum2);
 }
 
 
 
 
+/* z-value at the quantile of the histogram, upper limit of the bin */
+float ZQuantile(gsl_histogram *histogram,float quantile)
+{
+  size_t i;
+  size_t nbins = gsl_histogram_bins (histogram);
+  gsl_histogram_pdf *pdf = gsl_histogram_pdf_alloc(nbins);
+  gsl_histogram_pdf_init(pdf,histogram);
+  double lower=0,upper=0;
+
+  for (i=nbins-1; i>=0; i--) {
+    gsl_histogram_get_range (histogram,i,&lower,&upper);
+    if (pdf->sum[i] < quantile) {
+      if (gsl_histogram_get_range (histogram,i,&lower,&upper) == GSL_EDOM) VError(" err hist");
+      break;
+    }
+  }
+  gsl_histogram_pdf_free (pdf);
+  return (float)upper;
+}
+
+
 float ZMatrix(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-	      VImage roi,VImage map,VImage mapimage,int adjdef,float elength,float quantile,int step,int metric)
+	      TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float quantile,int step,int metric)
 {
   size_t i;
   size_t nvox=SNR1->size1;
@@ -204,7 +192,6 @@ float ZMatrix(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *
   fprintf(stderr," Computing matrix...\n");
 
   gsl_histogram_reset(histogram);
-  size_t nbins = gsl_histogram_bins (histogram);
   double hmax = gsl_histogram_max (histogram);
   double hmin = gsl_histogram_min (histogram);
   double zmin = 99999.0;
@@ -212,43 +199,40 @@ float ZMatrix(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *
   int minadj = 1;
 
 
-#pragma omp parallel for shared(progress,histogram) schedule(dynamic) firstprivate(SNR1,SNR2)
+#pragma omp parallel shared(progress,histogram) firstprivate(SNR1,SNR2)
+  {
+  /* histogram of this thread */
+  gsl_histogram *tmphist = gsl_histogram_clone (histogram);
+
+#pragma omp for schedule(dynamic)
   for (i=0; i<nvox; i+=step) {
     if (i%1000 == 0) fprintf(stderr," %ld000\r",(long)progress++);
     int bi = (int)VPixel(map,0,0,i,VShort);
     int ri = (int)VPixel(map,0,1,i,VShort);
     int ci = (int)VPixel(map,0,2,i,VShort);
-    int nadjx = VNumNeigbours(i,map,mapimage,adjdef);
+    int nadjx = (int)(adj->off[i+1] - adj->off[i]);
     if (nadjx < minadj) continue;
 
-    int roiflagi = 0;
-    if (roi != NULL) {
-      if (VGetPixel(roi,bi,ri,ci) > 0.5) roiflagi = 1;
-    }
-
-    gsl_histogram *tmphist = gsl_histogram_alloc (nbins);
-    gsl_histogram_set_ranges_uniform (tmphist,hmin,hmax);
-    gsl_histogram_reset(tmphist);
-    
     const float *datax1 = gsl_matrix_float_const_ptr(SNR1,i,0);
     const float *datax2 = gsl_matrix_float_const_ptr(SNR2,i,0);
 
+    /* in ROI mode only voxels on the other side of the ROI border */
+    size_t j=0,k,kmax;
+    const int *jlist = NULL;
+    if (roi != NULL) jlist = VRoiPartners(roi,i,&kmax);
+    else kmax = (i+step-1)/step;
 
-    size_t j=0;
-    for (j=0; j<i; j+=step) {
+    for (k=0; k<kmax; k++) {
+      j = (roi != NULL) ? (size_t)jlist[k] : k*step;
+      if (j%step != 0) continue;
       int bj = (int)VPixel(map,0,0,j,VShort);
       int rj = (int)VPixel(map,0,1,j,VShort);
       int cj = (int)VPixel(map,0,2,j,VShort);
       int d = SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj);
       if (d < rad2) continue;
-      int nadjy = VNumNeigbours(j,map,mapimage,adjdef);
+      int nadjy = (int)(adj->off[j+1] - adj->off[j]);
       if (nadjy < minadj) continue;
 
-      int roiflagj = 0;
-      if (roi != NULL) {
-	if (VGetPixel(roi,bj,rj,cj) > 0.5) roiflagj = 1;
-	if (roiflagi + roiflagj != 1) continue; 
-      }
       const float *datay1 = gsl_matrix_float_const_ptr(SNR1,j,0);
       const float *datay2 = gsl_matrix_float_const_ptr(SNR2,j,0);
 
@@ -263,33 +247,319 @@ float ZMatrix(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *
       if (z > hmax-tiny) z = hmax-tiny;
       gsl_histogram_increment (tmphist,z);
     }
+  }
+#pragma omp critical
+  {
+    gsl_histogram_add (histogram,tmphist);
+  }
+  gsl_histogram_free (tmphist);
+  }
 
 
-#pragma omp critical 
-    {
-      gsl_histogram_add (histogram,tmphist);
+  return ZQuantile(histogram,quantile);
+}
+
+
+
+/*
+** the z-value exceeded by the top 'fraction' of the m sampled values in z,
+** *share is the proportion m/nz of valid samples
+*/
+float PilotQuantile(float *z,char *valid,size_t nz,double fraction,double *share)
+{
+  size_t l,m=0;
+  for (l=0; l<nz; l++) {
+    if (valid[l]) z[m++] = z[l];
+  }
+  *share = (nz > 0) ? (double)m/(double)nz : 1.0;
+  float zpre = -1.0;   /* no sample, all pairs are candidates */
+  if (m > 0) {
+    size_t k = (size_t)((1.0-fraction)*(double)m);
+    if (k >= m) k = m-1;
+    zpre = kth_smallest(z,m,k);
+  }
+  return zpre;
+}
+
+
+/*
+** Conservative pre-threshold for the fused pass: the z-value exceeded by
+** the top 'fraction' of a sparse sample of voxel pairs.
+** In ROI mode, the sample is drawn from the pairs joining the ROI to its complement.
+** *share is the proportion of sampled pairs that are long enough and have neighbours.
+*/
+float PilotThreshold(gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,TEDRoi *roi,VImage map,TEDAdjacency *adj,
+		     int rad2,double fraction,int metric,double *share)
+{
+  size_t r,l,nvox=SNR1->size1;
+  int nt=SNR1->size2;
+  float zpre=0;
+
+  if (roi != NULL) {
+    /* every ps-th pair of the ROI x complement block, at most PILOTPAIRS pairs and 1/64 of all */
+    size_t npairs = roi->nin*roi->nout;
+    size_t ps = (npairs+PILOTPAIRS-1)/PILOTPAIRS;
+    if (ps < 64) ps = 64;
+    size_t nz = npairs/ps;
+    float *z = (float *) VCalloc(nz+1,sizeof(float));
+    char *valid = (char *) VCalloc(nz+1,sizeof(char));
+
+#pragma omp parallel for schedule(dynamic,256)
+    for (l=0; l<nz; l++) {
+      size_t p = l*ps + (l*7919)%ps;   /* jitter, avoids aliasing with the block width */
+      size_t a = (size_t)roi->in[p/roi->nout];
+      size_t b = (size_t)roi->out[p%roi->nout];
+      size_t i = (a > b) ? a : b;
+      size_t j = (a > b) ? b : a;
+      int bi = (int)VPixel(map,0,0,i,VShort);
+      int ri = (int)VPixel(map,0,1,i,VShort);
+      int ci = (int)VPixel(map,0,2,i,VShort);
+      int bj = (int)VPixel(map,0,0,j,VShort);
+      int rj = (int)VPixel(map,0,1,j,VShort);
+      int cj = (int)VPixel(map,0,2,j,VShort);
+      if (SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj) < rad2) continue;
+      if (adj->off[i+1] == adj->off[i] || adj->off[j+1] == adj->off[j]) continue;
+      double z1 = EdgeCorr(gsl_matrix_float_const_ptr(SNR1,i,0),gsl_matrix_float_const_ptr(SNR1,j,0),nt,metric);
+      double z2 = EdgeCorr(gsl_matrix_float_const_ptr(SNR2,i,0),gsl_matrix_float_const_ptr(SNR2,j,0),nt,metric);
+      z[l] = (float)(z1-z2);
+      valid[l] = 1;
     }
-    gsl_histogram_free (tmphist);
+    zpre = PilotQuantile(z,valid,nz,fraction,share);
+    VFree(z);
+    VFree(valid);
+    return zpre;
   }
 
+  /* at most PILOTPAIRS pairs, and at most 1/64 of all pairs */
+  size_t ps = (size_t)ceil((double)nvox/sqrt(2.0*(double)PILOTPAIRS));
+  if (ps < 8) ps = 8;
+  size_t nr = (nvox+ps-1)/ps;
 
-  /* get quantile cutoff */
-  gsl_histogram_pdf *pdf = gsl_histogram_pdf_alloc(nbins);
-  gsl_histogram_pdf_init(pdf,histogram);
-  double lower=0,upper=0;
+  /* sampled row r has r pairs, starting at r(r-1)/2 */
+  float *z = (float *) VCalloc(nr*(nr-1)/2+1,sizeof(float));
+  char *valid = (char *) VCalloc(nr*(nr-1)/2+1,sizeof(char));
 
-  size_t i0=0;
-  for (i=nbins-1; i>=0; i--) {
-    gsl_histogram_get_range (histogram,i,&lower,&upper);
-    if (pdf->sum[i] < quantile) {
-      if (gsl_histogram_get_range (histogram,i,&lower,&upper) == GSL_EDOM) VError(" err hist");
-      i0 = i;
-      break;
+#pragma omp parallel for private(l) schedule(dynamic,16)
+  for (r=1; r<nr; r++) {
+    size_t i = r*ps;
+    size_t k0 = r*(r-1)/2;
+    int bi = (int)VPixel(map,0,0,i,VShort);
+    int ri = (int)VPixel(map,0,1,i,VShort);
+    int ci = (int)VPixel(map,0,2,i,VShort);
+    if (adj->off[i+1] == adj->off[i]) continue;
+    const float *datax1 = gsl_matrix_float_const_ptr(SNR1,i,0);
+    const float *datax2 = gsl_matrix_float_const_ptr(SNR2,i,0);
+
+    for (l=0; l<r; l++) {
+      size_t j = l*ps;
+      int bj = (int)VPixel(map,0,0,j,VShort);
+      int rj = (int)VPixel(map,0,1,j,VShort);
+      int cj = (int)VPixel(map,0,2,j,VShort);
+      if (SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj) < rad2) continue;
+      if (adj->off[j+1] == adj->off[j]) continue;
+      const float *datay1 = gsl_matrix_float_const_ptr(SNR1,j,0);
+      const float *datay2 = gsl_matrix_float_const_ptr(SNR2,j,0);
+      double z1 = EdgeCorr(datax1,datay1,nt,metric);
+      double z2 = EdgeCorr(datax2,datay2,nt,metric);
+      z[k0+l] = (float)(z1-z2);
+      valid[k0+l] = 1;
     }
   }
-  double sum=0;
-  for (i=nbins-1; i>i0; i--) {
-    sum += gsl_histogram_get(histogram,i);
+
+  zpre = PilotQuantile(z,valid,nr*(nr-1)/2,fraction,share);
+  VFree(z);
+  VFree(valid);
+  return zpre;
+}
+
+
+/* candidate edges of a block of rows */
+typedef struct CandBufferStruct {
+  size_t n;
+  size_t cap;
+  int *col;
+} CandBuffer;
+
+
+void CandAppend(CandBuffer *buf,int j)
+{
+  if (buf->n >= buf->cap) {
+    buf->cap = (buf->cap < 1024) ? 1024 : 2*buf->cap;
+    buf->col = (int *) VRealloc(buf->col,buf->cap*sizeof(int));
   }
-  return (float)upper;
+  buf->col[buf->n++] = j;
+}
+
+
+void VCandidatesFree(TEDCandidates *cand)
+{
+  if (cand == NULL) return;
+  VFree(cand->off);
+  VFree(cand->col);
+  VFree(cand);
+}
+
+
+/*
+** Fused pass: one sweep over all voxel pairs computes each z-value once.
+** Pairs on the grid of 'step' feed the quantile histogram exactly as in ZMatrix,
+** all pairs above a pre-threshold from a pilot sample are kept as candidate edges.
+** Returns the z-threshold. *cand is NULL if the pre-threshold turned out to
+** exceed the z-threshold, or if there are more than CANDMAX candidates,
+** EdgeDensity must then visit all pairs. Candidates are no longer collected
+** once CANDMAX is exceeded, so that at most about 3*CANDMAX ints are held,
+** and only pairs on the grid are visited from then on. If the pilot sample
+** predicts more than CANDMAX candidates, ZMatrix is called instead.
+*/
+float ZMatrixFused(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
+		   TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float quantile,int step,int metric,
+		   TEDCandidates **cand)
+{
+  size_t blk;
+  size_t nvox=SNR1->size1;
+  int nt=SNR1->size2;
+  size_t progress=0;
+  int rad2 = (int)(elength*elength);
+  double tiny=1.0e-8;
+  int minadj = 1;
+  gsl_set_error_handler_off ();
+
+  /* keep about four times as many pairs as the quantile admits */
+  double fraction = 4.0*(1.0-(double)quantile) + 0.001;
+  if (fraction > 1.0) fraction = 1.0;
+  double share=1;
+  float zpre = PilotThreshold(SNR1,SNR2,roi,map,adj,rad2,fraction,metric,&share);
+
+  /* too many candidates expected, the plain pass is cheaper than a sweep that overflows */
+  double npairs = (roi != NULL) ? (double)roi->nin*(double)roi->nout : 0.5*(double)nvox*(double)(nvox-1);
+  double expected = fraction*share*npairs;
+  if (expected > (double)CANDMAX) {
+    fprintf(stderr," about %.0f candidates expected, more than %ld, not fusing\n",expected,(long)CANDMAX);
+    *cand = NULL;
+    return ZMatrix(histogram,SNR1,SNR2,n1,n2,roi,map,adj,elength,quantile,step,metric);
+  }
+
+  fprintf(stderr," Computing matrix...\n");
+
+  gsl_histogram_reset(histogram);
+  double hmax = gsl_histogram_max (histogram);
+  double hmin = gsl_histogram_min (histogram);
+
+  size_t nblocks = (nvox+ROWBLOCK-1)/ROWBLOCK;
+  CandBuffer *buf = (CandBuffer *) VCalloc(nblocks,sizeof(CandBuffer));
+  size_t *off = (size_t *) VCalloc(nvox+1,sizeof(size_t));
+  size_t ncand = 0;
+  int overflow = 0;
+
+#pragma omp parallel shared(progress,histogram,buf,off,ncand,overflow)
+  {
+  gsl_histogram *tmphist = gsl_histogram_clone (histogram);
+
+#pragma omp for schedule(dynamic)
+  for (blk=0; blk<nblocks; blk++) {
+    size_t i,j;
+    if (blk%16 == 0) fprintf(stderr," %ld of %ld\r",(long)progress++,(long)(nblocks+15)/16);
+
+    for (i=blk*ROWBLOCK; i<(blk+1)*ROWBLOCK && i<nvox; i++) {
+      int bi = (int)VPixel(map,0,0,i,VShort);
+      int ri = (int)VPixel(map,0,1,i,VShort);
+      int ci = (int)VPixel(map,0,2,i,VShort);
+      int nadjx = (int)(adj->off[i+1] - adj->off[i]);
+      if (nadjx < minadj) continue;
+
+      int ongrid = (i%step == 0);
+      size_t n0 = buf[blk].n;
+      int full;
+#pragma omp atomic read
+      full = overflow;
+      if (full && !ongrid) continue;   /* only the histogram is still needed */
+
+      const float *datax1 = gsl_matrix_float_const_ptr(SNR1,i,0);
+      const float *datax2 = gsl_matrix_float_const_ptr(SNR2,i,0);
+
+      /* in ROI mode only voxels on the other side of the ROI border */
+      size_t k,kmax=i;
+      const int *jlist = NULL;
+      if (roi != NULL) jlist = VRoiPartners(roi,i,&kmax);
+
+      for (k=0; k<kmax; k++) {
+	j = (roi != NULL) ? (size_t)jlist[k] : k;
+	if (full && j%step != 0) continue;
+	int bj = (int)VPixel(map,0,0,j,VShort);
+	int rj = (int)VPixel(map,0,1,j,VShort);
+	int cj = (int)VPixel(map,0,2,j,VShort);
+	int d = SQR(bi-bj) + SQR(ri-rj) + SQR(ci-cj);
+	if (d < rad2) continue;
+	int nadjy = (int)(adj->off[j+1] - adj->off[j]);
+	if (nadjy < minadj) continue;
+
+	const float *datay1 = gsl_matrix_float_const_ptr(SNR1,j,0);
+	const float *datay2 = gsl_matrix_float_const_ptr(SNR2,j,0);
+
+	/* edge z-value */
+	double z1 = EdgeCorr(datax1,datay1,nt,metric);
+	double z2 = EdgeCorr(datax2,datay2,nt,metric);
+	double z = (z1-z2);
+	if (!full && z >= zpre) CandAppend(&buf[blk],(int)j);
+
+	if (ongrid && j%step == 0) {
+	  if (z < hmin) z = hmin;
+	  if (z > hmax-tiny) z = hmax-tiny;
+	  gsl_histogram_increment (tmphist,z);
+	}
+      }
+      off[i+1] = buf[blk].n - n0;
+
+      /* candidate memory exhausted */
+      if (!full) {
+	size_t total;
+#pragma omp atomic capture
+	{ ncand += off[i+1]; total = ncand; }
+	if (total > CANDMAX) {
+#pragma omp atomic write
+	  overflow = 1;
+	}
+      }
+    }
+  }
+#pragma omp critical
+  {
+    gsl_histogram_add (histogram,tmphist);
+  }
+  gsl_histogram_free (tmphist);
+  }
+
+  float zthr = ZQuantile(histogram,quantile);
+
+  /* pre-threshold not conservative or too many candidates, candidates are incomplete */
+  if (zthr < zpre || overflow) {
+    if (overflow)
+      fprintf(stderr," more than %ld candidates, visiting all pairs\n",(long)CANDMAX);
+    else
+      fprintf(stderr," pre-threshold %.4f above z-threshold %.4f, visiting all pairs\n",zpre,zthr);
+    for (blk=0; blk<nblocks; blk++) VFree(buf[blk].col);
+    VFree(buf);
+    VFree(off);
+    *cand = NULL;
+    return zthr;
+  }
+
+  /* concatenate buffers */
+  TEDCandidates *C = (TEDCandidates *) VCalloc(1,sizeof(TEDCandidates));
+  C->nvox = nvox;
+  C->off = off;
+  for (blk=0; blk<nvox; blk++) off[blk+1] += off[blk];
+  C->col = (int *) VCalloc(off[nvox]+1,sizeof(int));
+
+#pragma omp parallel for schedule(dynamic)
+  for (blk=0; blk<nblocks; blk++) {
+    if (buf[blk].n > 0) memcpy(&C->col[off[blk*ROWBLOCK]],buf[blk].col,buf[blk].n*sizeof(int));
+    VFree(buf[blk].col);
+  }
+  VFree(buf);
+
+  fprintf(stderr," candidates: %ld,  pre-threshold: %.4f,  z-threshold: %.4f\n",
+	  (long)off[nvox],zpre,zthr);
+  *cand = C;
+  return zthr;
 }
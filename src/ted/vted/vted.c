@@ -26,6 +26,9 @@
 #include "viaio/VImage.h"
 #include "viaio/mu.h"
 #include "viaio/option.h"
+#include "via/via.h"
+
+#include "vted.h"
 
 
 #ifdef _OPENMP
@@ -42,19 +45,19 @@ extern void   VDataMatrix(VImage *src,int first,int len,VImage map,gsl_matrix_fl
 extern void   VCheckMatrix(gsl_matrix_float *X);
 extern long   VMaskCoverage(VAttrList list,VImage mask);
 extern float  ZMatrix(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-		      VImage roi,VImage map,VImage,int,float elength,float quantile,int,int);
+		      TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float quantile,int,int);
 extern void   GetSNR(gsl_matrix_float **X1,gsl_matrix_float **X2,int *,int n,gsl_matrix_float *SNR,int);
 extern void   GetMedian(gsl_matrix_float **X1,gsl_matrix_float **X2,int *,int n,gsl_matrix_float *SNR,int);
 extern void   VPrintHistogram(gsl_histogram *histogram,int numperm,VString filename);
 extern void   HistoUpdate(float *A,size_t nvox,gsl_histogram *hist);
 
-extern size_t EdgeDensity(float *C,int *I,int *J,size_t nedges,
+extern size_t EdgeDensity(float *C,int *I,int *J,size_t nedges,VEdgeFile ef,
 			  gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-			  VImage roi,VImage map,VImage,int,float,float,int,int,int,float,int);
+			  TEDRoi *roi,VImage map,TEDAdjacency *adj,TEDCandidates *cand,float,float,int,int,int,float,int);
 
 extern size_t EstimateEdges(float *E,int *I,int *J,size_t fulldim,
 			    gsl_histogram *TedHist,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
-			    VImage roi,VImage map,VImage mapimage,int adjdef,float elength,float zthreshold,float,int);
+			    TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float zthreshold,float,int);
 
 
 /* generate permutation table */
@@ -153,6 +156,81 @@ gsl_matrix_float **VReadImageData(VStringConst *in_filenames,VImage *src,VImage
 
 
 
+/* buffers of a team of threads that runs permutations */
+typedef struct TEDTeamStruct {
+  gsl_matrix_float *SNR1;  /* SNR time courses of both conditions */
+  gsl_matrix_float *SNR2;
+  gsl_histogram *ZvalHist; /* z-values, for the z-threshold */
+  gsl_histogram *TedHist;  /* edge densities, summed over the permutations of the team */
+} TEDTeam;
+
+
+/*
+** one permutation: SNR time courses, z-threshold and edge densities.
+** Edges are only kept in the last permutation. They are either written
+** to 'ef' while they are computed, or collected in the edge arrays, which
+** may be reallocated there.
+*/
+size_t RunPermutation(TEDTeam *team,gsl_matrix_float **X1,gsl_matrix_float **X2,int *table,int ks,size_t n,
+		      int n1,int n2,TEDRoi *roi,VImage map,TEDAdjacency *adj,int type,int metric,int step,
+		      float elength,float qthreshold,float noise_cutoff,VBoolean histonly,VBoolean fused,
+		      int nperm,int numperm,VEdgeFile ef,float **E,int **I,int **J,size_t *nedges_estimated)
+{
+  size_t s,nedges;
+  TEDCandidates *cand = NULL;
+  char str[256];
+
+  for (s=0; s<n && s<sizeof(str)-1; s++) str[s] = (table[s] == 0) ? '0' : '1';
+  str[s] = '\0';
+  fprintf(stderr,"\n perm %3d: %s  %3d\n",nperm,str,ks);
+
+
+  /* get SNR data */
+  if (type == 0) {
+    GetSNR(X1,X2,table,n,team->SNR1,metric);
+    GetSNR(X2,X1,table,n,team->SNR2,metric);
+  }
+  if (type == 1) {
+    GetMedian(X1,X2,table,n,team->SNR1,metric);
+    GetMedian(X2,X1,table,n,team->SNR2,metric);
+  }
+
+
+  /* corr matrices */
+  float zthr = 0;
+  if (fused)
+    zthr = ZMatrixFused(team->ZvalHist,team->SNR1,team->SNR2,n1,n2,roi,map,adj,
+			elength,qthreshold,step,metric,&cand);
+  else
+    zthr = ZMatrix(team->ZvalHist,team->SNR1,team->SNR2,n1,n2,roi,map,adj,
+		   elength,qthreshold,step,metric);
+
+  /* estimate number of truly needed edges, estimate noise */
+  if (noise_cutoff > 0.0 && nperm == numperm && histonly == FALSE && ef != NULL) {
+    gsl_histogram_reset(team->TedHist);  /* as in EstimateEdges, streamed edges need no arrays */
+  }
+  else if (noise_cutoff > 0.0 && nperm == numperm && histonly == FALSE) {
+    size_t old_estimate = *nedges_estimated;
+    *nedges_estimated = EstimateEdges(*E,*I,*J,old_estimate,team->TedHist,team->SNR1,team->SNR2,n1,n2,
+				      roi,map,adj,elength,zthr,noise_cutoff,metric);
+
+    *E = VCalloc(*nedges_estimated,sizeof(float));  /* matrix of edge densities */
+    *I = VCalloc(*nedges_estimated,sizeof(int));    /* row indices in matrix E */
+    *J = VCalloc(*nedges_estimated,sizeof(int));    /* col indices in matrix E */
+  }
+
+
+  /* edge densities */
+  fprintf(stderr," Computing edge densities...\n");
+  nedges = EdgeDensity(*E,*I,*J,*nedges_estimated,ef,team->TedHist,team->SNR1,team->SNR2,n1,n2,roi,map,adj,
+		       cand,elength,zthr,nperm,numperm,(int)1,noise_cutoff,metric);
+  VCandidatesFree(cand);
+  return nedges;
+}
+
+
+
+
 VDictEntry ADJDict[] = {
   { "6", 0 },
   { "18", 1 },
@@ -172,6 +250,12 @@ VDictEntry MetricDict[] = {
   { NULL }
 };
 
+VDictEntry FormatDict[] = {
+  { "vista", 0 },
+  { "compact", 1 },
+  { NULL }
+};
+
 
 int main (int argc,char *argv[])
 {
@@ -191,7 +275,10 @@ int main (int argc,char *argv[])
   static VShort   numperm = 0;
   static VShort   type = 0;
   static VShort   metric = 0;
+  static VShort   format = 0;
   static VShort   nproc = 10;
+  static VShort   teams = 1;
+  static VBoolean fused = FALSE;
   static VShort   step = 2;
   static VOptionDescRec  options[] = {
     {"in1", VStringRepn, 0, & in_files1, VRequiredOpt, NULL,"Input files 1" },
@@ -208,8 +295,11 @@ int main (int argc,char *argv[])
     {"len",VShortRepn,1,(VPointer) &len,VOptionalOpt,NULL,"Number of timepoints to use, '0' to use all"},
     {"type",VShortRepn,1,(VPointer) &type,VOptionalOpt,TypeDict,"Type of trial average"},
     {"metric",VShortRepn,1,(VPointer) &metric,VOptionalOpt,MetricDict,"Correlation metric"},
+    {"format",VShortRepn,1,(VPointer) &format,VOptionalOpt,FormatDict,"Output format of edge list"},
     {"edgelength",VFloatRepn,1,(VPointer) &elength,VOptionalOpt,NULL,"Minimal edge length in voxels"},   
     {"j",VShortRepn,1,(VPointer) &nproc,VOptionalOpt,NULL,"Number of processors to use, '0' to use all"},
+    {"teams",VShortRepn,1,(VPointer) &teams,VOptionalOpt,NULL,"Number of permutations to run concurrently"},
+    {"fused",VBooleanRepn,1,(VPointer) &fused,VOptionalOpt,NULL,"Whether to compute z-threshold and candidate edges in one pass"},
     /*     {"noisecutoff",VFloatRepn,1,(VPointer) &noise_cutoff,VOptionalOpt,NULL,"estimate of noisy edges"}, */
     /*     {"step",VShortRepn,1,(VPointer) &step,VOptionalOpt,NULL,"first iteration ZMatrix step size"} */
   };
@@ -336,15 +426,13 @@ int main (int argc,char *argv[])
   gsl_matrix_float **X2 = VReadImageData(in_filenames2,src,map,n2,nvox,first,len);
 
  
-  /* voxel addresses */
-  VImage mapimage = VCreateImage(nslices,nrows,ncols,VIntegerRepn);
-  VFillImage(mapimage,VAllBands,(VInteger)(-1));
-  for (i=0; i<nvox; i++) {
-    int b = VPixel(map,0,0,i,VShort);
-    int r = VPixel(map,0,1,i,VShort);
-    int c = VPixel(map,0,2,i,VShort);
-    VPixel(mapimage,b,r,c,VInteger) = (VInteger)i;
-  }
+  /* voxel neighbourhoods */
+  TEDAdjacency *adj = VAdjacency(map,nslices,nrows,ncols,(int)adjdef);
+
+
+  /* voxels inside and outside the ROI, only pairs joining the two are visited */
+  TEDRoi *roilist = NULL;
+  if (roi != NULL) roilist = VRoiIndex(roi,map);
 
 
   /* tmp storage for SNR time courses */
@@ -390,70 +478,107 @@ int main (int argc,char *argv[])
   size_t nedges_estimated = (size_t) (qx*(double)fulldim);
 
 
+  /* compact output is written while the edges of the last permutation are computed */
+  FILE *fp_out = NULL;
+  VEdgeFile ef = NULL;
+  if (histonly == FALSE && format == 1) {
+    VAttrList meta = VCreateAttrList();
+    VSetGeoInfo(geolist,meta);
+    VAppendAttr(meta,"map",NULL,VImageRepn,map);
+    VAppendAttr(meta,"qthreshold",NULL,VFloatRepn,(VFloat)qthreshold);
+    fp_out = VOpenOutputFile (out_filename, TRUE);
+    ef = VEdgeFileCreate(fp_out,meta,nvox,1.0);
+  }
+
+
   /* ini matrices */
   float *E=NULL;   /* matrix of edge densities */
   int *I=NULL;     /* row indices in matrix E */
   int *J=NULL;     /* col indices in matrix E */
 
-  if (histonly == FALSE && noise_cutoff < 0.00001) {
+  if (histonly == FALSE && noise_cutoff < 0.00001 && format == 0) {
     E = VCalloc(nedges_estimated,sizeof(float));  /* matrix of edge densities */
     I = VCalloc(nedges_estimated,sizeof(int));    /* row indices in matrix E */
     J = VCalloc(nedges_estimated,sizeof(int));    /* col indices in matrix E */
   }
 
 
-  /* main loop */
+  /* permutation tables, drawn in advance so that results do not depend on the number of teams */
   size_t s;
-  int ks=0,nperm=0;
+  int nperm=0;
   int startperm=0;
   if (numperm > 0) startperm = 1;
-
-
+  int nrun = numperm-startperm+1;
+  int *tables = (int *) VCalloc(nrun*n,sizeof(int));
+  int *ks = (int *) VCalloc(nrun,sizeof(int));
   for (nperm = startperm; nperm <= numperm; nperm++) {
-
-    fprintf(stderr,"\n perm %3d: ",nperm);
     if (nperm > 0) {
-      ks = genperm(rx,table,n,(int)numperm);
-    }
-    for (s=0; s<n; s++) {
-      fprintf(stderr,"%d",table[s]);
+      ks[nperm-startperm] = genperm(rx,table,n,(int)numperm);
     }
-    fprintf(stderr,"  %3d\n",ks);
-
+    for (s=0; s<n; s++) tables[(nperm-startperm)*n+s] = table[s];
+  }
 
-    /* get SNR data */
-    if (type == 0) {
-      GetSNR(X1,X2,table,n,SNR1,metric);
-      GetSNR(X2,X1,table,n,SNR2,metric);
-    }
-    if (type == 1) {
-      GetMedian(X1,X2,table,n,SNR1,metric);
-      GetMedian(X2,X1,table,n,SNR2,metric);
-    }
 
+  /*
+  ** All but the last permutation run concurrently on 'nteams' teams of threads.
+  ** Each team has its own SNR buffers and histograms, the data X1,X2 are shared.
+  ** The last permutation yields the edges and uses all threads.
+  */
+  int t,nteams = (int)teams;
+  int tthreads = 1;
+  if (nteams > nrun-1) nteams = nrun-1;
+  if (nteams < 1) nteams = 1;
+#ifdef _OPENMP
+  if (nteams > jprocs) nteams = jprocs;
+  tthreads = jprocs/nteams;
+  if (nteams > 1) {
+    omp_set_max_active_levels(2);
+    fprintf(stderr," %d teams of %d threads\n",nteams,tthreads);
+  }
+#endif /* _OPENMP */
 
-    /* corr matrices */
-    float zthr = ZMatrix(ZvalHist,SNR1,SNR2,n1,n2,roi,map,mapimage,(int)adjdef,
-			 (float)elength,(float)qthreshold,(int)step,(int)metric);
-    
-    /* estimate number of truly needed edges, estimate noise */
-    if (noise_cutoff > 0.0 && nperm == numperm && histonly == FALSE) {
-      size_t old_estimate = nedges_estimated;
-      nedges_estimated = EstimateEdges(E,I,J,old_estimate,TedHist,SNR1,SNR2,n1,n2,roi,map,mapimage,
-				       (int)adjdef,elength,zthr,noise_cutoff,(int)metric);
-      
-      E = VCalloc(nedges_estimated,sizeof(float));  /* matrix of edge densities */
-      I = VCalloc(nedges_estimated,sizeof(int));    /* row indices in matrix E */
-      J = VCalloc(nedges_estimated,sizeof(int));    /* col indices in matrix E */
-    }
+  TEDTeam *team = (TEDTeam *) VCalloc(nteams,sizeof(TEDTeam));
+  team[0].SNR1 = SNR1;
+  team[0].SNR2 = SNR2;
+  team[0].ZvalHist = ZvalHist;
+  team[0].TedHist = TedHist;
+  for (t=1; t<nteams; t++) {
+    team[t].SNR1 = gsl_matrix_float_calloc(nvox,dim);
+    team[t].SNR2 = gsl_matrix_float_calloc(nvox,dim);
+    if (!team[t].SNR1 || !team[t].SNR2) VError(" err allocating SNR buffers of team %d",t);
+    team[t].ZvalHist = gsl_histogram_clone(ZvalHist);
+    team[t].TedHist = gsl_histogram_clone(TedHist);
+  }
 
+  int p;
+#pragma omp parallel for num_threads(nteams) schedule(dynamic) if(nteams > 1)
+  for (p=0; p<nrun-1; p++) {
+    int id=0;
+#ifdef _OPENMP
+    id = omp_get_thread_num();
+    omp_set_num_threads(tthreads);
+#endif /* _OPENMP */
+    RunPermutation(&team[id],X1,X2,&tables[p*n],ks[p],n,n1,n2,roilist,map,adj,(int)type,(int)metric,
+		   (int)step,(float)elength,(float)qthreshold,(float)noise_cutoff,histonly,
+		   fused,startperm+p,(int)numperm,NULL,&E,&I,&J,&nedges_estimated);
+  }
 
-    /* edge densities */
-    fprintf(stderr," Computing edge densities...\n");
-    nedges = EdgeDensity(E,I,J,nedges_estimated,TedHist,SNR1,SNR2,n1,n2,roi,map,mapimage,(int)adjdef,
-			 elength,zthr,nperm,numperm,(int)1,noise_cutoff,(int)metric);
+  /* merge histograms of the teams */
+  for (t=1; t<nteams; t++) {
+    gsl_histogram_add(TedHist,team[t].TedHist);
+    gsl_matrix_float_free(team[t].SNR1);
+    gsl_matrix_float_free(team[t].SNR2);
+    gsl_histogram_free(team[t].ZvalHist);
+    gsl_histogram_free(team[t].TedHist);
   }
 
+  nedges = RunPermutation(&team[0],X1,X2,&tables[(nrun-1)*n],ks[nrun-1],n,n1,n2,roilist,map,adj,(int)type,
+			  (int)metric,(int)step,(float)elength,(float)qthreshold,(float)noise_cutoff,histonly,
+			  fused,(int)numperm,(int)numperm,ef,&E,&I,&J,&nedges_estimated);
+  VFree(team);
+  VFree(tables);
+  VFree(ks);
+
   
   /* free storage */
   for (i=0; i<n; i++) {
@@ -462,6 +587,8 @@ int main (int argc,char *argv[])
   }
   gsl_matrix_float_free(SNR1);
   gsl_matrix_float_free(SNR2);
+  VAdjacencyFree(adj);
+  VRoiFree(roilist);
   VFree(table);
 
 
@@ -474,6 +601,17 @@ int main (int argc,char *argv[])
   }
 
 
+  /* finish compact output, edges are sorted by row and column */
+  if (format == 1) {
+    VEdgeFileClose(ef);
+    float filesize = (float)ftell(fp_out)/(1000.0*1000.0);
+    fclose(fp_out);
+    fprintf(stderr," nedges= %ld,  filesize= %.3f MByte\n",nedges,filesize);
+    fprintf (stderr," %s: done.\n\n", argv[0]);
+    exit(0);
+  }
+
+
   /* write edge density matrix in triplet sparse format */
   size_t edim = nedges*3;
   float filesize1 = (float)(edim*sizeof(float))/(1000.0*1000.0);
@@ -498,7 +636,7 @@ int main (int argc,char *argv[])
   VAppendAttr(out_list,"map",NULL,VImageRepn,map);
   VAppendAttr(out_list,"qthreshold",NULL,VFloatRepn,(VFloat)qthreshold);
 
-  FILE *fp_out = VOpenOutputFile (out_filename, TRUE);
+  fp_out = VOpenOutputFile (out_filename, TRUE);
   if (! VWriteFile (fp_out, out_list)) exit (1);
   fclose(fp_out);
   fprintf (stderr," %s: done.\n\n", argv[0]);
@@ -0,0 +1,48 @@
+/*
+** TED - data structures shared by the modules of vted
+*/
+
+/* neighbourhoods of all voxels in compressed sparse row (CSR) format */
+typedef struct TEDAdjacencyStruct {
+  size_t nvox;             /* number of voxels */
+  int    adjdef;           /* neighbourhood definition [6|18|26|sphere] */
+  int    maxadj;           /* largest possible neighbourhood */
+  size_t *off;             /* neighbours of voxel i are nbr[off[i]...off[i+1]-1], nvox+1 entries */
+  int    *nbr;             /* voxel indices of neighbours, scan order */
+  size_t span;             /* largest index difference within a neighbourhood */
+} TEDAdjacency;
+
+
+/* candidate edges (i,j), j < i, of the fused pass, CSR format */
+typedef struct TEDCandidatesStruct {
+  size_t nvox;             /* number of voxels */
+  size_t *off;             /* candidates of row i are col[off[i]...off[i+1]-1], nvox+1 entries */
+  int    *col;             /* column indices j, ascending within a row */
+} TEDCandidates;
+
+
+/* voxels inside and outside the ROI, in ROI mode each edge joins one voxel of either list */
+typedef struct TEDRoiStruct {
+  size_t nvox;             /* number of voxels */
+  char   *inside;          /* 1 if voxel i is in the ROI, else 0 */
+  size_t nin;              /* number of voxels in the ROI */
+  int    *in;              /* voxels in the ROI, ascending */
+  size_t nout;             /* number of voxels outside the ROI */
+  int    *out;             /* voxels outside the ROI, ascending */
+} TEDRoi;
+
+
+/* VoxelMap.c */
+extern TEDRoi *VRoiIndex(VImage roi,VImage map);
+extern const int *VRoiPartners(const TEDRoi *roi,size_t i,size_t *n);
+extern void VRoiFree(TEDRoi *roi);
+
+/* Adjacency.c */
+extern TEDAdjacency *VAdjacency(VImage map,int nslices,int nrows,int ncols,int adjdef);
+extern void VAdjacencyFree(TEDAdjacency *adj);
+
+/* ZMatrix.c */
+extern float ZMatrixFused(gsl_histogram *histogram,gsl_matrix_float *SNR1,gsl_matrix_float *SNR2,int n1,int n2,
+			  TEDRoi *roi,VImage map,TEDAdjacency *adj,float elength,float quantile,int step,int metric,
+			  TEDCandidates **cand);
+extern void VCandidatesFree(TEDCandidates *cand);